@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "flowproto.h"
+
+#define MAX_ARGS 64
+
+void serveSession(int sock, int *running);
+void answerLoad(int sock, int *running);
+int runCommand(int sock, char *payload, uint32_t length, int compressFlags, int *running);
+void killCommand(pid_t pid);
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: ./flow-agent [address:]port\n");
+        return 1;
+    }
+
+    // the agent runs whatever it is sent, even loopback is shared with every local user
+    const char *secret = getenv(SECRET_ENV);
+    if (!secret || !*secret) {
+        fprintf(stderr, "Error: %s must be set, flow-agent only serves clients that know it\n", SECRET_ENV);
+        return 1;
+    }
+
+    int listener = listenAgent(argv[1]);
+    if (listener < 0) {
+        perror("Error listening for flow clients");
+        return 1;
+    }
+
+    // number of commands running right now, shared with every session child for FRAME_LOAD
+    int *running = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (running == MAP_FAILED) {
+        perror("mmap failed for load counter");
+        return 1;
+    }
+    *running = 0;
+
+    // sessions are never waited for here, let the kernel reap them
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept failed");
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            // the session waits for its own command, so it needs the default SIGCHLD back
+            signal(SIGCHLD, SIG_DFL);
+            close(listener);
+            serveSession(sock, running);
+            _exit(0);
+        }
+        else if (pid < 0) {
+            perror("fork failed for session");
+        }
+        close(sock);
+    }
+}
+
+void serveSession(int sock, int *running) {
+    frameHeader header;
+    char *payload = malloc(FRAME_MAX_PAYLOAD + 1);
+    if (!payload || readFrame(sock, &header, payload) < 0) {
+        free(payload);
+        return;
+    }
+
+    // nothing is answered before the client has shown the shared secret
+    if (header.type != FRAME_AUTH || !secretMatches(payload, header.length)) {
+        fprintf(stderr, "flow-agent: rejected a client without the right secret\n");
+        // say so, and let the client close first so the answer isn't lost to a reset
+        sendFrame(sock, FRAME_AUTH, 0, NULL, 0);
+        shutdown(sock, SHUT_WR);
+        while (read(sock, payload, FRAME_MAX_PAYLOAD) > 0)
+            ;
+        free(payload);
+        close(sock);
+        return;
+    }
+    if (readFrame(sock, &header, payload) < 0) {
+        free(payload);
+        close(sock);
+        return;
+    }
+
+    if (header.type == FRAME_LOAD) {
+        answerLoad(sock, running);
+    }
+    else if (header.type == FRAME_EXEC) {
+        payload[header.length] = '\0';
+        int status = runCommand(sock, payload, header.length, header.flags, running);
+        sendCount(sock, FRAME_EXIT, status);
+
+        // closing with the client's last credits unread would reset the connection and
+        // could throw away output it has not read yet, so let the client close first
+        shutdown(sock, SHUT_WR);
+        while (read(sock, payload, FRAME_MAX_PAYLOAD) > 0)
+            ;
+    }
+    else {
+        fprintf(stderr, "flow-agent: unexpected frame type %d\n", header.type);
+    }
+
+    free(payload);
+    close(sock);
+}
+
+void answerLoad(int sock, int *running) {
+    double load = 0;
+    FILE *fp = fopen("/proc/loadavg", "r");
+    if (fp) {
+        if (fscanf(fp, "%lf", &load) != 1)
+            load = 0;
+        fclose(fp);
+    }
+
+    char reply[128];
+    int len = snprintf(reply, sizeof(reply), "%d %ld %.2f", __atomic_load_n(running, __ATOMIC_SEQ_CST), sysconf(_SC_NPROCESSORS_ONLN), load);
+    sendFrame(sock, FRAME_LOAD, 0, reply, len);
+}
+
+void killCommand(pid_t pid) {
+    // the whole process group, a wrapper script's children included
+    if (kill(-pid, SIGKILL) < 0)
+        kill(pid, SIGKILL);
+}
+
+int runCommand(int sock, char *payload, uint32_t length, int compressFlags, int *running) {
+    // --- argv arrives as NUL separated strings ---
+    char *args[MAX_ARGS];
+    int argCount = 0;
+    for (uint32_t off = 0; off < length && argCount < MAX_ARGS - 1; off += strlen(payload + off) + 1)
+        args[argCount++] = payload + off;
+    args[argCount] = NULL;
+    if (argCount == 0)
+        return 1;
+
+    int in[2], out[2], err[2];
+    if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        return 1;
+    }
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        // own process group, so a kill reaches everything the command starts
+        setpgid(0, 0);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        execvp(args[0], args);
+        fprintf(stderr, "execvp failed\n");
+        _exit(1);
+    }
+    setpgid(pid, 0);  // also here, so a kill right after fork already finds the group
+    __atomic_add_fetch(running, 1, __ATOMIC_SEQ_CST);
+
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    int stdinFd = in[1];
+    fcntl(stdinFd, F_SETFL, O_NONBLOCK);
+
+    // stdin bytes received but not yet taken by the command, never more than FLOW_WINDOW
+    char *pending = malloc(FLOW_WINDOW);
+    char *frame = malloc(FRAME_MAX_PAYLOAD);
+    char *data = malloc(DATA_CHUNK);
+    if (!pending || !frame || !data) {
+        perror("malloc failed for session buffers");
+        killCommand(pid);
+        return 1;
+    }
+    uint32_t pendingLength = 0;
+    int stdinEof = 0;
+    edgeCodec codec;
+    memset(&codec, 0, sizeof(codec));
+    int outOpen = 1, errOpen = 1;
+    long credit = FLOW_WINDOW;   // stdout + stderr bytes we may still send unacknowledged
+
+    // --- Pump until the command has closed both of its outputs ---
+    while (outOpen || errOpen) {
+        struct pollfd fds[4];
+        int count = 0;
+        int sockSlot = count;
+        fds[count++] = (struct pollfd){sock, POLLIN, 0};
+        int outSlot = -1, errSlot = -1, inSlot = -1;
+        if (outOpen && credit > 0) {
+            outSlot = count;
+            fds[count++] = (struct pollfd){out[0], POLLIN, 0};
+        }
+        if (errOpen && credit > 0) {
+            errSlot = count;
+            fds[count++] = (struct pollfd){err[0], POLLIN, 0};
+        }
+        if (stdinFd >= 0 && pendingLength > 0) {
+            inSlot = count;
+            fds[count++] = (struct pollfd){stdinFd, POLLOUT, 0};
+        }
+
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll failed");
+            break;
+        }
+
+        if (fds[sockSlot].revents) {
+            frameHeader header;
+            if (readFrame(sock, &header, frame) < 0) {
+                // the client is gone, nobody is left to read the results
+                killCommand(pid);
+                break;
+            }
+            if (header.type == FRAME_STDIN) {
+                long n = decodeData(&header, frame, data, &codec);
+                if (n < 0 || pendingLength + n > FLOW_WINDOW) {
+                    fprintf(stderr, "flow-agent: bad stdin frame\n");
+                    killCommand(pid);
+                    break;
+                }
+                if (stdinFd >= 0) {
+                    memcpy(pending + pendingLength, data, n);
+                    pendingLength += n;
+                }
+                else {
+                    // the command stopped reading, drop it but keep the client moving
+                    if (sendCount(sock, FRAME_CREDIT, n) < 0) {
+                        killCommand(pid);
+                        break;
+                    }
+                }
+            }
+            else if (header.type == FRAME_EOF) {
+                stdinEof = 1;
+            }
+            else if (header.type == FRAME_CREDIT) {
+                credit += frameCount(frame);
+            }
+        }
+
+        if (inSlot >= 0 && fds[inSlot].revents) {
+            ssize_t w = write(stdinFd, pending, pendingLength);
+            if (w > 0) {
+                memmove(pending, pending + w, pendingLength - w);
+                pendingLength -= w;
+                if (sendCount(sock, FRAME_CREDIT, w) < 0) {
+                    killCommand(pid);
+                    break;
+                }
+            }
+            else if (w < 0 && errno != EAGAIN && errno != EINTR) {
+                // the command closed its stdin, release what it will never read
+                sendCount(sock, FRAME_CREDIT, pendingLength);
+                pendingLength = 0;
+                close(stdinFd);
+                stdinFd = -1;
+            }
+        }
+        if (stdinFd >= 0 && stdinEof && pendingLength == 0) {
+            close(stdinFd);
+            stdinFd = -1;
+        }
+
+        int slots[2] = {outSlot, errSlot};
+        int fdsOut[2] = {out[0], err[0]};
+        int types[2] = {FRAME_STDOUT, FRAME_STDERR};
+        int *open[2] = {&outOpen, &errOpen};
+        for (int k = 0; k < 2; k++) {
+            if (slots[k] < 0 || !fds[slots[k]].revents)
+                continue;
+            ssize_t n = read(fdsOut[k], data, credit < DATA_CHUNK ? credit : DATA_CHUNK);
+            if (n <= 0) {
+                *open[k] = 0;
+                continue;
+            }
+            if (sendData(sock, types[k], data, n, compressFlags & COMPRESS_STDOUT ? &codec : NULL) < 0) {
+                // the client is gone, same as a failed read above
+                killCommand(pid);
+                outOpen = errOpen = 0;
+                break;
+            }
+            credit -= n;
+        }
+    }
+
+    if (stdinFd >= 0)
+        close(stdinFd);
+    close(out[0]);
+    close(err[0]);
+    codecEnd(&codec);
+    free(pending);
+    free(frame);
+    free(data);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    __atomic_sub_fetch(running, 1, __ATOMIC_SEQ_CST);
+
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
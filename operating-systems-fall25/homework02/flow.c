@@ -1,27 +1,74 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <poll.h>
+
+#include "flowproto.h"
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
 
 #define MAX_FLOW_DEPTH 64
 #define MAX_FORK_LIMIT 50
+#define MAX_INCLUDE_DEPTH 16
+#define RING_SIZE (1 << 20)   // must be a power of two
+#define RING_CHUNK (64 * 1024)  // bytes file blocks move per read/write, also used by --bench-transport
+#define MAX_NODE_RLIMITS 8
+#define MAX_AGENTS 32
+#define MAX_LIVE_STAGES 8
+#define CANCEL_GRACE_MS 200    // SIGTERM to SIGKILL
+#define MAX_CANCEL_TREE 256    // processes cancelStage follows below one stage
+
+// what a pipe or concatenate block does when one of its stages fails
+#define POLICY_DEFAULT   -1    // use --policy
+#define POLICY_FAIL_FAST 0     // cancel the rest, report the first failure
+#define POLICY_CONTINUE  1     // run everything, report the last stage (like the shell)
+#define POLICY_PIPEFAIL  2     // run everything, report the rightmost failure
+
+typedef struct {
+    int resource;
+    rlim_t value;
+} nodeRlimit;
 
 typedef struct {
     char *name;
     char *command;
+    char *cpus;                     // cpus= list such as 0-3,6, NULL inherits the parent mask
+    int hasNice;
+    int nice;
+    int hasIoprio;
+    int ioprio;                     // ioprio= rt/N, be/N or idle, as the value ioprio_set takes
+    int rlimitCount;
+    nodeRlimit rlimits[MAX_NODE_RLIMITS];
+    char *host;                     // host= agent address, auto (least loaded agent) or local
+    int compress;                   // compress= edges as COMPRESS_* flags
 } nodeDef;
 
 typedef struct {
     char *name;
     char *from;
     char*to;
+    int policy;
 } pipeDef;
 
 typedef struct {
     char *name;
     int partCount;
     char **parts;
+    int policy;
 } concatDef;
 
 typedef struct {
@@ -34,20 +81,215 @@ typedef struct {
     char *fileName;
 } fileDef;
 
+// single producer / single consumer byte ring shared between two forked stages
+typedef struct {
+    // producer's line: the busy stream only ever stores here from the producer side
+    unsigned long head __attribute__((aligned(64)));   // total bytes written
+    int producerWaiting;
+    int spaceSeq;                                       // futex word the producer sleeps on
+    // consumer's line
+    unsigned long tail __attribute__((aligned(64)));   // total bytes read
+    int consumerWaiting;
+    int dataSeq;                                        // futex word the consumer sleeps on
+    int closed __attribute__((aligned(64)));
+    int readerClosed;
+    char data[] __attribute__((aligned(64)));
+} ringBuffer;
+
+// where a cpu sits, used by --pin to order cpus
+typedef struct {
+    int cpu;
+    int numaNode;       // -1 when the kernel has no NUMA info
+    int cacheGroup;     // lowest cpu sharing the last level cache
+    int threadIndex;    // 0 for the first hardware thread of a core, 1 for its SMT sibling, ...
+    int core;           // lowest cpu of the core
+} cpuTopology;
+
+// which block the parser is currently filling in, plus the array capacities
+typedef struct {
+    nodeDef *currentNode;
+    pipeDef *currentPipe;
+    concatDef *currentConcat;
+    stderrDef *currentStderr;
+    fileDef *currentFile;
+    int nodeCap, pipeCap, concatCap, stderrCap, fileCap;
+} parseState;
+
+// where a block header lives, found by the first (index only) pass of --lazy
+typedef struct {
+    char *name;
+    int fileIndex;
+    long offset;
+    int loaded;
+} blockIndexEntry;
+
+typedef struct {
+    blockIndexEntry *entries;
+    int entryCount, entryCap;
+    int *buckets;           // open addressing hash of entry positions, -1 = empty
+    int bucketCap;
+    char **fileNames;       // every file reached through include=
+    int fileNameCount, fileNameCap;
+    FILE *openFile;         // only the file loadReachable used last is kept open
+    int openFileIndex;
+} flowIndex;
+
 void freeMem(nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef* files, int fileCount);
 void parseFlowFile(const char *filename, nodeDef **nodes, int *nodeCount, pipeDef **pipes, int *pipeCount, concatDef **concats, int *concatCount, stderrDef **stderrs, int *stderrCount, fileDef **files, int *fileCount);
 int directivePresent (const char *directive, nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef *files, int fileCount);
+void parseFlowFileInto(const char *filename, int includeDepth, parseState *state, nodeDef **nodes, int *nodeCount, pipeDef **pipes, int *pipeCount, concatDef **concats, int *concatCount, stderrDef **stderrs, int *stderrCount, fileDef **files, int *fileCount);
+void parseFlowLine(char *lineBuffer, parseState *state, nodeDef **nodes, int *nodeCount, pipeDef **pipes, int *pipeCount, concatDef **concats, int *concatCount, stderrDef **stderrs, int *stderrCount, fileDef **files, int *fileCount);
+int blockHeaderLength(const char *line);
+void clearCurrentBlock(parseState *state);
+void resolveIncludePath(const char *baseFile, const char *includeName, char *out, size_t outSize);
+void indexFlowFile(const char *filename, int includeDepth, flowIndex *index);
+unsigned long hashBlockName(const char *name);
+int findIndexEntry(flowIndex *index, const char *name);
+void addIndexEntry(flowIndex *index, const char *name, int fileIndex, long offset);
+void loadReachable(flowIndex *index, const char *directive, nodeDef **nodes, int *nodeCount, pipeDef **pipes, int *pipeCount, concatDef **concats, int *concatCount, stderrDef **stderrs, int *stderrCount, fileDef **files, int *fileCount);
+void freeIndex(flowIndex *index);
+ringBuffer *ringCreate(void);
+void ringDestroy(ringBuffer *ring);
+long ringWrite(ringBuffer *ring, const char *buffer, long n);
+long ringRead(ringBuffer *ring, char *buffer, long n);
+void ringClose(ringBuffer *ring);
+void ringCloseReader(ringBuffer *ring);
+int isEngineManaged(const char *blockName, fileDef *files, int fileCount);
+void futexWait(int *word, int expected);
+void futexWake(int *word);
+double elapsedSeconds(struct timespec *start);
+void benchTransport(long totalBytes);
+int parseRlimitName(const char *name);
+int parseIoprio(const char *text);
+int parseCpuList(const char *list, cpu_set_t *set);
+int applyNodeSettings(nodeDef *node, int pinnedCpu);
+int readFirstCpu(const char *path);
+void orderCpusByTopology(int *cpus, int count);
+int compareCpuTopology(const void *a, const void *b);
+int countStages(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, int depth);
+void traceStage(const char *name, pid_t pid, int pinnedCpu, int status);
+const char *pickAgent(nodeDef *node, int stage);
+double queryAgentLoad(const char *hostPort);
+int runRemoteNode(const char *hostPort, char **args, int compressFlags);
+int parsePolicy(const char *name);
+int blockPolicy(int policy);
+int exitStatus(int waitStatus);
+void forwardSignal(int sig);
+void escalateKill(int sig);
+void installStageHandlers(void);
+void signalStage(pid_t pid, int sig);
+pid_t forkStage(void);
+int waitStage(pid_t pid, int options);
+int cancelStage(pid_t pid, const char *name);
+void blockStageSignals(sigset_t *saved);
+int collectStageTree(pid_t root, pid_t *tree, int max);
+int processRunning(pid_t pid);
+int waitPipeSides(pid_t fromPid, pid_t toPid, const char *fromName, const char *toName, int policy, ringBuffer *ring);
 char **splitCommand(const char *command);
 void freeArgs(char **args);
-void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef *files, int fileCount);
+int executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef *files, int fileCount);
 int hasCycleUtil(const char *block, nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef *files, int fileCount, char **visited, char **recStack, int depth);
 int detectCycles( nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef *files, int fileCount); 
 
+// set while a file block talks through a ring instead of stdin/stdout
+ringBuffer *flowOutRing = NULL;
+ringBuffer *flowInRing = NULL;
+
+// --pin places stage n of the flow on pinCpus[n % pinCpuCount]
+int pinStages = 0;
+int *pinCpus = NULL;
+int pinCpuCount = 0;
+int pinBase = 0;        // stage number the next node in this process gets
+
+// --trace writes one line per finished node here
+int traceFd = -1;
+
+// --agents=host:port,... are the flow-agent workers nodes can be scheduled on
+char *agentList[MAX_AGENTS];
+int agentCount = 0;
+
+// --policy for blocks without their own policy=
+int flowPolicy = POLICY_CONTINUE;
+
+// stages this process has started and not reaped yet, SIGTERM is forwarded to them
+pid_t liveChildren[MAX_LIVE_STAGES];
+volatile sig_atomic_t liveCount = 0;
+volatile sig_atomic_t cancelled = 0;   // the signal that cancelled this process, 0 if none
+int stageGroups = 0;    // stages lead their own process group, only when flow has no controlling terminal
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: ./flow <flowfile> <directive>\n");
+    int lazy = 0;
+    int argi = 1;
+
+    // --- Leading options ---
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--lazy") == 0) {
+            lazy = 1;
+        }
+        else if (strcmp(argv[argi], "--pin") == 0) {
+            pinStages = 1;
+        }
+        else if (strcmp(argv[argi], "--trace") == 0) {
+            // keep the real stderr, stderr blocks redirect fd 2 in their children
+            traceFd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+        }
+        else if (strncmp(argv[argi], "--trace=", 8) == 0) {
+            traceFd = open(argv[argi] + 8, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (traceFd < 0) {
+                perror("Error opening trace file");
+                return 1;
+            }
+        }
+        else if (strncmp(argv[argi], "--policy=", 9) == 0) {
+            flowPolicy = parsePolicy(argv[argi] + 9);
+            if (flowPolicy < 0) {
+                fprintf(stderr, "Unknown policy: %s (fail_fast, continue or pipefail)\n", argv[argi] + 9);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[argi], "--agents=", 9) == 0) {
+            // argv outlives the run, so the list can point straight into it
+            for (char *agent = strtok(argv[argi] + 9, ","); agent && agentCount < MAX_AGENTS; agent = strtok(NULL, ","))
+                agentList[agentCount++] = agent;
+        }
+        else if (strncmp(argv[argi], "--bench-transport", 17) == 0) {
+            // ./flow --bench-transport[=megabytes] compares the ring against pipe()
+            long megabytes = argv[argi][17] == '=' ? atol(argv[argi] + 18) : 256;
+            benchTransport((megabytes > 0 ? megabytes : 256) << 20);
+            return 0;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[argi]);
+            fprintf(stderr, "Usage: ./flow [--lazy] [--pin] [--trace[=file]] [--agents=host:port,...] [--policy=fail_fast|continue|pipefail] <flowfile> <directive>\n");
+            return 1;
+        }
+        argi++;
+    }
+
+    if (argc - argi != 2) {
+        fprintf(stderr, "Usage: ./flow [--lazy] [--pin] [--trace[=file]] [--agents=host:port,...] [--policy=fail_fast|continue|pipefail] <flowfile> <directive>\n");
         return 1;
     }
+    const char *flowFile = argv[argi];
+    const char *directive = argv[argi + 1];
+
+    if (pinStages) {
+        // pin onto the CPUs flow itself may use, ordered so neighbouring stages share a cache
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+            perror("sched_getaffinity failed");
+            return 1;
+        }
+        pinCpus = malloc(CPU_SETSIZE * sizeof(int));
+        if (!pinCpus) {
+            perror("malloc failed for pin cpus");
+            return 1;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                pinCpus[pinCpuCount++] = cpu;
+        orderCpusByTopology(pinCpus, pinCpuCount);
+    }
     
     // --- Allocate and initialize all structures ---
     nodeDef *nodes = NULL;
@@ -57,16 +299,26 @@ int main(int argc, char *argv[]) {
     fileDef *files = NULL;
     int nodeCount = 0, pipeCount = 0, concatCount = 0, stderrCount = 0, fileCount = 0;
     
-    parseFlowFile(argv[1], &nodes, &nodeCount, &pipes, &pipeCount, &concats, &concatCount, &stderrs, &stderrCount, &files, &fileCount);
+    if (lazy) {
+        // --- Index every block header, then parse only what the directive reaches ---
+        flowIndex index;
+        memset(&index, 0, sizeof(index));
+        indexFlowFile(flowFile, 0, &index);
+        loadReachable(&index, directive, &nodes, &nodeCount, &pipes, &pipeCount, &concats, &concatCount, &stderrs, &stderrCount, &files, &fileCount);
+        freeIndex(&index);
+    }
+    else {
+        parseFlowFile(flowFile, &nodes, &nodeCount, &pipes, &pipeCount, &concats, &concatCount, &stderrs, &stderrCount, &files, &fileCount);
+    }
 
-    if (!directivePresent(argv[2], nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount)) {
+    if (!directivePresent(directive, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount)) {
         fprintf(stderr, "The directive provided is not present in the flow file.\n");
         freeMem(nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount); 
         return 1;
     }
 
-    // if no nodes, execute flow will enter infinite recursion
-    if (nodeCount == 0) {
+    // if no nodes (or files, which flow runs itself), execute flow will enter infinite recursion
+    if (nodeCount == 0 && fileCount == 0) {
         fprintf(stderr, "No node directive present in the flow file.\n");
         freeMem(nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount); 
         return 1;
@@ -78,11 +330,24 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
-    executeFlow(argv[2], nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
+    // with a controlling terminal the stages have to stay in flow's (foreground) group, or
+    // reading the terminal stops them with SIGTTIN and Ctrl-Z no longer reaches them
+    int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (tty < 0)
+        stageGroups = 1;
+    else
+        close(tty);
+
+    // SIGTERM or Ctrl-C on flow itself cancels the running stages the same way fail_fast does
+    installStageHandlers();
+
+    int status = executeFlow(directive, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
 
     freeMem(nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount); 
+    free(pinCpus);
 
-    return 0;
+    // flow exits with the directive's result, or like a killed process if it was cancelled
+    return cancelled ? 128 + cancelled : status;
 }
 
 void freeMem(nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef* files, int fileCount) {
@@ -94,6 +359,8 @@ void freeMem(nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, conca
         for (int i = 0; i < nodeCount; i++) {
             free(nodes[i].name);
             free(nodes[i].command);
+            free(nodes[i].cpus);
+            free(nodes[i].host);
         }
         free(nodes);
     }
@@ -140,225 +407,596 @@ void freeMem(nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, conca
 }
 
 void parseFlowFile(const char *filename, nodeDef **nodes, int *nodeCount, pipeDef **pipes, int *pipeCount, concatDef **concats, int *concatCount, stderrDef **stderrs, int *stderrCount, fileDef **files, int *fileCount) {
+    parseState state;
+    memset(&state, 0, sizeof(state));
+    parseFlowFileInto(filename, 0, &state, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
+}
+
+void parseFlowFileInto(const char *filename, int includeDepth, parseState *state, nodeDef **nodes, int *nodeCount, pipeDef **pipes, int *pipeCount, concatDef **concats, int *concatCount, stderrDef **stderrs, int *stderrCount, fileDef **files, int *fileCount) {
+    if (includeDepth > MAX_INCLUDE_DEPTH) {
+        fprintf(stderr, "Error: include depth exceeded at '%s' (possible cyclical include)\n", filename);
+        freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+        exit(1);
+    }
+
     FILE *fp = fopen(filename, "r");
     if (!fp) {
         perror("Error opening flow file");
+        freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
         exit(1);
     }
 
     char lineBuffer[512];
-    nodeDef *currentNode = NULL;
-    pipeDef *currentPipe = NULL;
-    concatDef *currentConcat = NULL;
-    stderrDef *currentStderr = NULL;
-    fileDef *currentFile = NULL;
-
-    int nodeCap = 0, pipeCap = 0, concatCap = 0, stderrCap = 0, fileCap = 0;
-    
     while (fgets(lineBuffer, sizeof(lineBuffer), fp)) {
         lineBuffer[strcspn(lineBuffer, "\n")] = '\0';
-        if (strlen(lineBuffer) == 0)
-            continue;
 
-        // --- NODE SECTION ---
-        if (strncmp(lineBuffer, "node=", 5) == 0) {
-            if (*nodes == NULL) {
-                nodeCap = 1;
-                *nodes = malloc(nodeCap * sizeof(nodeDef));
-                if (!*nodes) {
-                    perror("malloc failed for nodes");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-            } 
-            else if (*nodeCount >= nodeCap) {
-                nodeCap *= 2;
-                nodeDef *tmp = realloc(*nodes, nodeCap * sizeof(nodeDef));
-                if (!tmp) {
-                    perror("realloc failed for nodes");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-                *nodes = tmp;
-            }
+        // --- INCLUDE SECTION ---
+        if (strncmp(lineBuffer, "include=", 8) == 0) {
+            char includePath[PATH_MAX];
+            resolveIncludePath(filename, lineBuffer + 8, includePath, sizeof(includePath));
 
-            currentNode = &(*nodes)[(*nodeCount)++];
-            currentNode->name = strdup(lineBuffer + 5);
-            currentNode->command = NULL;
+            // an include always ends the current block
+            clearCurrentBlock(state);
+            parseFlowFileInto(includePath, includeDepth + 1, state, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
+            clearCurrentBlock(state);
             continue;
         }
 
-        if (strncmp(lineBuffer, "command=", 8) == 0 && currentNode) {
-            currentNode->command = strdup(lineBuffer + 8);
-            continue;
-        }
+        parseFlowLine(lineBuffer, state, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
+    }
 
-        // --- PIPE SECTION ---
-        if (strncmp(lineBuffer, "pipe=", 5) == 0) {
-            if (*pipes == NULL) {
-                pipeCap = 1;
-                *pipes = malloc(pipeCap * sizeof(pipeDef));
-                if (!*pipes) {
-                    perror("malloc failed for pipes");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-            } 
-            else if (*pipeCount >= pipeCap) {
-                pipeCap *= 2;
-                pipeDef *tmp = realloc(*pipes, pipeCap * sizeof(pipeDef));
-                if (!tmp) {
-                    perror("realloc failed for pipes");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-                *pipes = tmp;
+    fclose(fp);
+}
+
+void parseFlowLine(char *lineBuffer, parseState *state, nodeDef **nodes, int *nodeCount, pipeDef **pipes, int *pipeCount, concatDef **concats, int *concatCount, stderrDef **stderrs, int *stderrCount, fileDef **files, int *fileCount) {
+    lineBuffer[strcspn(lineBuffer, "\n")] = '\0';
+    if (strlen(lineBuffer) == 0)
+        return;
+
+    // a new block header ends whatever block was being filled in
+    if (blockHeaderLength(lineBuffer) > 0)
+        clearCurrentBlock(state);
+
+    // --- NODE SECTION ---
+    if (strncmp(lineBuffer, "node=", 5) == 0) {
+        if (*nodes == NULL) {
+            state->nodeCap = 1;
+            *nodes = malloc(state->nodeCap * sizeof(nodeDef));
+            if (!*nodes) {
+                perror("malloc failed for nodes");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
+            }
+        } 
+        else if (*nodeCount >= state->nodeCap) {
+            state->nodeCap *= 2;
+            nodeDef *tmp = realloc(*nodes, state->nodeCap * sizeof(nodeDef));
+            if (!tmp) {
+                perror("realloc failed for nodes");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
             }
+            *nodes = tmp;
+        }
 
-            currentPipe = &(*pipes)[(*pipeCount)++];
-            currentPipe->name = strdup(lineBuffer + 5);
-            currentPipe->from = NULL;
-            currentPipe->to = NULL;
-            continue;
+        state->currentNode = &(*nodes)[(*nodeCount)++];
+        memset(state->currentNode, 0, sizeof(nodeDef));
+        state->currentNode->name = strdup(lineBuffer + 5);
+        state->currentNode->command = NULL;
+        return;
+    }
+
+    if (strncmp(lineBuffer, "command=", 8) == 0 && state->currentNode) {
+        state->currentNode->command = strdup(lineBuffer + 8);
+        return;
+    }
+
+    if (strncmp(lineBuffer, "cpus=", 5) == 0 && state->currentNode) {
+        cpu_set_t set;
+        if (parseCpuList(lineBuffer + 5, &set) < 0) {
+            fprintf(stderr, "Error: node '%s' has an invalid cpus list '%s'\n", state->currentNode->name, lineBuffer + 5);
+            freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+            exit(1);
         }
+        state->currentNode->cpus = strdup(lineBuffer + 5);
+        return;
+    }
 
-        if (strncmp(lineBuffer, "from=", 5) == 0 && currentPipe) {
-            currentPipe->from = strdup(lineBuffer + 5);
-            continue;
+    if (strncmp(lineBuffer, "nice=", 5) == 0 && state->currentNode) {
+        char *end;
+        long nice = strtol(lineBuffer + 5, &end, 10);
+        if (end == lineBuffer + 5 || *end != '\0' || nice < -20 || nice > 19) {
+            fprintf(stderr, "Error: node '%s' has an invalid nice value '%s'\n", state->currentNode->name, lineBuffer + 5);
+            freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+            exit(1);
         }
+        state->currentNode->hasNice = 1;
+        state->currentNode->nice = nice;
+        return;
+    }
 
-        if (strncmp(lineBuffer, "to=", 3) == 0 && currentPipe) {
-            currentPipe->to = strdup(lineBuffer + 3);
-            continue;
+    if (strncmp(lineBuffer, "ioprio=", 7) == 0 && state->currentNode) {
+        int ioprio = parseIoprio(lineBuffer + 7);
+        if (ioprio < 0) {
+            fprintf(stderr, "Error: node '%s' has an invalid ioprio '%s'\n", state->currentNode->name, lineBuffer + 7);
+            freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+            exit(1);
+        }
+        state->currentNode->hasIoprio = 1;
+        state->currentNode->ioprio = ioprio;
+        return;
+    }
+
+    if (strncmp(lineBuffer, "policy=", 7) == 0 && (state->currentPipe || state->currentConcat)) {
+        int policy = parsePolicy(lineBuffer + 7);
+        if (policy < 0) {
+            fprintf(stderr, "Error: unknown policy '%s'\n", lineBuffer + 7);
+            freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+            exit(1);
         }
+        if (state->currentPipe)
+            state->currentPipe->policy = policy;
+        else
+            state->currentConcat->policy = policy;
+        return;
+    }
 
-        // --- CONCAT SECTION ---
-        if (strncmp(lineBuffer, "concatenate=", 12) == 0) {
-            if (*concats == NULL) {
-                concatCap = 1;
-                *concats = malloc(concatCap * sizeof(concatDef));
-                if (!*concats) {
-                    perror("malloc failed for concats");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-            } 
-            else if (*concatCount >= concatCap) {
-                concatCap *= 2;
-                concatDef *tmp = realloc(*concats, concatCap * sizeof(concatDef));
-                if (!tmp) {
-                    perror("realloc failed for concats");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-                *concats = tmp;
+    if (strncmp(lineBuffer, "host=", 5) == 0 && state->currentNode) {
+        state->currentNode->host = strdup(lineBuffer + 5);
+        return;
+    }
+
+    if (strncmp(lineBuffer, "compress=", 9) == 0 && state->currentNode) {
+        const char *edges = lineBuffer + 9;
+        if (strcmp(edges, "stdin") == 0)
+            state->currentNode->compress = COMPRESS_STDIN;
+        else if (strcmp(edges, "stdout") == 0)
+            state->currentNode->compress = COMPRESS_STDOUT;
+        else if (strcmp(edges, "both") == 0)
+            state->currentNode->compress = COMPRESS_STDIN | COMPRESS_STDOUT;
+        else
+            state->currentNode->compress = 0;
+        return;
+    }
+
+    if (strncmp(lineBuffer, "rlimit_", 7) == 0 && state->currentNode) {
+        char *eq = strchr(lineBuffer, '=');
+        if (!eq) 
+            return;
+        *eq = '\0';
+        int resource = parseRlimitName(lineBuffer + 7);
+        if (resource < 0 || state->currentNode->rlimitCount >= MAX_NODE_RLIMITS) {
+            fprintf(stderr, "Error: node '%s' has an unknown or extra limit 'rlimit_%s'\n", state->currentNode->name, lineBuffer + 7);
+            freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+            exit(1);
+        }
+        rlim_t value = RLIM_INFINITY;
+        if (strcmp(eq + 1, "unlimited") != 0) {
+            char *end;
+            errno = 0;
+            value = strtoull(eq + 1, &end, 10);
+            if (end == eq + 1 || *end != '\0' || eq[1] == '-' || errno == ERANGE) {
+                fprintf(stderr, "Error: node '%s' has an invalid limit 'rlimit_%s=%s'\n", state->currentNode->name, lineBuffer + 7, eq + 1);
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
             }
+        }
+        nodeRlimit *limit = &state->currentNode->rlimits[state->currentNode->rlimitCount++];
+        limit->resource = resource;
+        limit->value = value;
+        return;
+    }
 
-            currentConcat = &(*concats)[(*concatCount)++];
-            memset(currentConcat, 0, sizeof(concatDef));
-            currentConcat->name = strdup(lineBuffer + 12);
-            currentConcat->partCount = 0;
-            currentConcat->parts = NULL;
-            continue;
+    // --- PIPE SECTION ---
+    if (strncmp(lineBuffer, "pipe=", 5) == 0) {
+        if (*pipes == NULL) {
+            state->pipeCap = 1;
+            *pipes = malloc(state->pipeCap * sizeof(pipeDef));
+            if (!*pipes) {
+                perror("malloc failed for pipes");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
+            }
+        } 
+        else if (*pipeCount >= state->pipeCap) {
+            state->pipeCap *= 2;
+            pipeDef *tmp = realloc(*pipes, state->pipeCap * sizeof(pipeDef));
+            if (!tmp) {
+                perror("realloc failed for pipes");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
+            }
+            *pipes = tmp;
         }
 
-        if (strncmp(lineBuffer, "parts=", 6) == 0 && currentConcat) {
-            int count = atoi(lineBuffer + 6);
-            if (count > 0) {
-                currentConcat->parts = calloc(count, sizeof(char *));
-                currentConcat->partCount = count;
+        state->currentPipe = &(*pipes)[(*pipeCount)++];
+        state->currentPipe->name = strdup(lineBuffer + 5);
+        state->currentPipe->from = NULL;
+        state->currentPipe->to = NULL;
+        state->currentPipe->policy = POLICY_DEFAULT;
+        return;
+    }
+
+    if (strncmp(lineBuffer, "from=", 5) == 0 && state->currentPipe) {
+        state->currentPipe->from = strdup(lineBuffer + 5);
+        return;
+    }
+
+    if (strncmp(lineBuffer, "to=", 3) == 0 && state->currentPipe) {
+        state->currentPipe->to = strdup(lineBuffer + 3);
+        return;
+    }
+
+    // --- CONCAT SECTION ---
+    if (strncmp(lineBuffer, "concatenate=", 12) == 0) {
+        if (*concats == NULL) {
+            state->concatCap = 1;
+            *concats = malloc(state->concatCap * sizeof(concatDef));
+            if (!*concats) {
+                perror("malloc failed for concats");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
             }
-            continue;
+        } 
+        else if (*concatCount >= state->concatCap) {
+            state->concatCap *= 2;
+            concatDef *tmp = realloc(*concats, state->concatCap * sizeof(concatDef));
+            if (!tmp) {
+                perror("realloc failed for concats");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
+            }
+            *concats = tmp;
         }
 
-        if (strncmp(lineBuffer, "part_", 5) == 0 && currentConcat) {
-            int index = atoi(lineBuffer + 5);
-            char *eq = strchr(lineBuffer, '=');
-            if (eq && index >= 0 && index < currentConcat->partCount) {
-                currentConcat->parts[index] = strdup(eq + 1);
+        state->currentConcat = &(*concats)[(*concatCount)++];
+        memset(state->currentConcat, 0, sizeof(concatDef));
+        state->currentConcat->name = strdup(lineBuffer + 12);
+        state->currentConcat->partCount = 0;
+        state->currentConcat->parts = NULL;
+        state->currentConcat->policy = POLICY_DEFAULT;
+        return;
+    }
+
+    if (strncmp(lineBuffer, "parts=", 6) == 0 && state->currentConcat) {
+        int count = atoi(lineBuffer + 6);
+        if (count > 0) {
+            state->currentConcat->parts = calloc(count, sizeof(char *));
+            state->currentConcat->partCount = count;
+        }
+        return;
+    }
+
+    if (strncmp(lineBuffer, "part_", 5) == 0 && state->currentConcat) {
+        int index = atoi(lineBuffer + 5);
+        char *eq = strchr(lineBuffer, '=');
+        if (eq && index >= 0 && index < state->currentConcat->partCount) {
+            state->currentConcat->parts[index] = strdup(eq + 1);
+        }
+        return;
+    }
+
+    // --- STDERR SECTION ---
+    if (strncmp(lineBuffer, "stderr=", 7) == 0) {
+        if (*stderrs == NULL) {
+            state->stderrCap = 1;
+            *stderrs = malloc(state->stderrCap * sizeof(stderrDef));
+            if (!*stderrs) {
+                perror("malloc failed for stderrs");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
             }
-            continue;
+        } 
+        else if (*stderrCount >= state->stderrCap) {
+            state->stderrCap *= 2;
+            stderrDef *tmp = realloc(*stderrs, state->stderrCap * sizeof(stderrDef));
+            if (!tmp) {
+                perror("realloc failed for stderrs");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
+            }
+            *stderrs = tmp;
         }
 
-        // --- STDERR SECTION ---
-        if (strncmp(lineBuffer, "stderr=", 7) == 0) {
-            if (*stderrs == NULL) {
-                stderrCap = 1;
-                *stderrs = malloc(stderrCap * sizeof(stderrDef));
-                if (!*stderrs) {
-                    perror("malloc failed for stderrs");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-            } 
-            else if (*stderrCount >= stderrCap) {
-                stderrCap *= 2;
-                stderrDef *tmp = realloc(*stderrs, stderrCap * sizeof(stderrDef));
-                if (!tmp) {
-                    perror("realloc failed for stderrs");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-                *stderrs = tmp;
+        state->currentStderr = &(*stderrs)[(*stderrCount)++];
+        state->currentStderr->name = strdup(lineBuffer + 7);
+        state->currentStderr->from = NULL;
+        return;
+    }
+
+    if (strncmp(lineBuffer, "from=", 5) == 0 && state->currentStderr) {
+        state->currentStderr->from = strdup(lineBuffer + 5);
+        return;
+    }
+
+    // --- FILE SECTION ---
+    if (strncmp(lineBuffer, "file=", 5) == 0) {
+        if (*files == NULL) {
+            state->fileCap = 1;
+            *files = malloc(state->fileCap * sizeof(fileDef));
+            if (!*files) {
+                perror("malloc failed for files");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
+            }
+        } 
+        else if (*fileCount >= state->fileCap) {
+            state->fileCap *= 2;
+            fileDef *tmp = realloc(*files, state->fileCap * sizeof(fileDef));
+            if (!tmp) {
+                perror("realloc failed for files");
+                freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+                exit(1);
             }
+            *files = tmp;
+        }
 
-            currentStderr = &(*stderrs)[(*stderrCount)++];
-            currentStderr->name = strdup(lineBuffer + 7);
-            currentStderr->from = NULL;
-            continue;
+        state->currentFile = &(*files)[(*fileCount)++];
+        state->currentFile->name = strdup(lineBuffer + 5);
+        state->currentFile->fileName = NULL;
+        return;
+    }
+    if (strncmp(lineBuffer, "name=", 5) == 0 && state->currentFile) {
+        state->currentFile->fileName = strdup(lineBuffer + 5);
+        return;
+    }
+}
+
+int blockHeaderLength(const char *line) {
+    if (strncmp(line, "node=", 5) == 0)
+        return 5;
+    if (strncmp(line, "pipe=", 5) == 0)
+        return 5;
+    if (strncmp(line, "concatenate=", 12) == 0)
+        return 12;
+    if (strncmp(line, "stderr=", 7) == 0)
+        return 7;
+    if (strncmp(line, "file=", 5) == 0)
+        return 5;
+    return 0;
+}
+
+void clearCurrentBlock(parseState *state) {
+    state->currentNode = NULL;
+    state->currentPipe = NULL;
+    state->currentConcat = NULL;
+    state->currentStderr = NULL;
+    state->currentFile = NULL;
+}
+
+void resolveIncludePath(const char *baseFile, const char *includeName, char *out, size_t outSize) {
+    // absolute includes are used as is, relative ones are relative to the including file
+    const char *slash = strrchr(baseFile, '/');
+    if (includeName[0] == '/' || !slash) {
+        snprintf(out, outSize, "%s", includeName);
+        return;
+    }
+    snprintf(out, outSize, "%.*s/%s", (int)(slash - baseFile), baseFile, includeName);
+}
+
+unsigned long hashBlockName(const char *name) {
+    // FNV-1a
+    unsigned long hash = 14695981039346656037UL;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+int findIndexEntry(flowIndex *index, const char *name) {
+    if (index->bucketCap == 0)
+        return -1;
+
+    unsigned long slot = hashBlockName(name) & (index->bucketCap - 1);
+    while (index->buckets[slot] != -1) {
+        if (strcmp(index->entries[index->buckets[slot]].name, name) == 0)
+            return index->buckets[slot];
+        slot = (slot + 1) & (index->bucketCap - 1);
+    }
+    return -1;
+}
+
+void addIndexEntry(flowIndex *index, const char *name, int fileIndex, long offset) {
+    // the first definition of a name wins, same as the linear scans in executeFlow
+    if (findIndexEntry(index, name) != -1)
+        return;
+
+    if (index->entryCount >= index->entryCap) {
+        int newCap = index->entryCap ? index->entryCap * 2 : 64;
+        blockIndexEntry *tmp = realloc(index->entries, newCap * sizeof(blockIndexEntry));
+        if (!tmp) {
+            perror("realloc failed for block index");
+            freeIndex(index);
+            exit(1);
         }
+        index->entries = tmp;
+        index->entryCap = newCap;
+    }
 
-        if (strncmp(lineBuffer, "from=", 5) == 0 && currentStderr) {
-            currentStderr->from = strdup(lineBuffer + 5);
-            continue;
+    // keep the hash table at most half full, rebuilding it when it grows
+    if ((index->entryCount + 1) * 2 > index->bucketCap) {
+        int newCap = index->bucketCap ? index->bucketCap * 2 : 128;
+        int *tmp = malloc(newCap * sizeof(int));
+        if (!tmp) {
+            perror("malloc failed for block index");
+            freeIndex(index);
+            exit(1);
         }
+        free(index->buckets);
+        index->buckets = tmp;
+        index->bucketCap = newCap;
+        memset(index->buckets, -1, newCap * sizeof(int));
+
+        for (int i = 0; i < index->entryCount; i++) {
+            unsigned long slot = hashBlockName(index->entries[i].name) & (newCap - 1);
+            while (index->buckets[slot] != -1)
+                slot = (slot + 1) & (newCap - 1);
+            index->buckets[slot] = i;
+        }
+    }
 
-        // --- FILE SECTION ---
-        if (strncmp(lineBuffer, "file=", 5) == 0) {
-            if (*files == NULL) {
-                fileCap = 1;
-                *files = malloc(fileCap * sizeof(fileDef));
-                if (!*files) {
-                    perror("malloc failed for files");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-            } 
-            else if (*fileCount >= fileCap) {
-                fileCap *= 2;
-                fileDef *tmp = realloc(*files, fileCap * sizeof(fileDef));
-                if (!tmp) {
-                    perror("realloc failed for files");
-                    fclose(fp);
-                    freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
-                    exit(1);
-                }
-                *files = tmp;
-            }
+    blockIndexEntry *entry = &index->entries[index->entryCount];
+    entry->name = strdup(name);
+    entry->fileIndex = fileIndex;
+    entry->offset = offset;
+    entry->loaded = 0;
 
-            currentFile = &(*files)[(*fileCount)++];
-            currentFile->name = strdup(lineBuffer + 5);
-            currentFile->fileName = NULL;
-            continue;
+    unsigned long slot = hashBlockName(name) & (index->bucketCap - 1);
+    while (index->buckets[slot] != -1)
+        slot = (slot + 1) & (index->bucketCap - 1);
+    index->buckets[slot] = index->entryCount++;
+}
+
+void indexFlowFile(const char *filename, int includeDepth, flowIndex *index) {
+    if (includeDepth > MAX_INCLUDE_DEPTH) {
+        fprintf(stderr, "Error: include depth exceeded at '%s' (possible cyclical include)\n", filename);
+        freeIndex(index);
+        exit(1);
+    }
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        perror("Error opening flow file");
+        freeIndex(index);
+        exit(1);
+    }
+
+    if (index->fileNameCount >= index->fileNameCap) {
+        int newCap = index->fileNameCap ? index->fileNameCap * 2 : 4;
+        char **names = realloc(index->fileNames, newCap * sizeof(char *));
+        if (!names) {
+            perror("realloc failed for block index");
+            fclose(fp);
+            freeIndex(index);
+            exit(1);
         }
-        if (strncmp(lineBuffer, "name=", 5) == 0 && currentFile) {
-            currentFile->fileName = strdup(lineBuffer + 5);
-            continue;
+        index->fileNames = names;
+        index->fileNameCap = newCap;
+    }
+
+    // loadReachable reopens the file by name and seeks straight to its blocks
+    int fileIndex = index->fileNameCount++;
+    index->fileNames[fileIndex] = strdup(filename);
+
+    // only headers are looked at here, attributes are skipped until a block is needed
+    char lineBuffer[512];
+    long offset = ftell(fp);
+    while (fgets(lineBuffer, sizeof(lineBuffer), fp)) {
+        lineBuffer[strcspn(lineBuffer, "\n")] = '\0';
+
+        int headerLength = blockHeaderLength(lineBuffer);
+        if (headerLength > 0) {
+            addIndexEntry(index, lineBuffer + headerLength, fileIndex, offset);
+        }
+        else if (strncmp(lineBuffer, "include=", 8) == 0) {
+            char includePath[PATH_MAX];
+            resolveIncludePath(filename, lineBuffer + 8, includePath, sizeof(includePath));
+            indexFlowFile(includePath, includeDepth + 1, index);
         }
+        offset = ftell(fp);
     }
 
+    // closed right away so a flow split over more files than the fd limit still loads
     fclose(fp);
 }
 
+void loadReachable(flowIndex *index, const char *directive, nodeDef **nodes, int *nodeCount, pipeDef **pipes, int *pipeCount, concatDef **concats, int *concatCount, stderrDef **stderrs, int *stderrCount, fileDef **files, int *fileCount) {
+    int start = findIndexEntry(index, directive);
+    if (start == -1)
+        return;  // main reports the missing directive
+
+    int *queue = malloc(index->entryCount * sizeof(int));
+    if (!queue) {
+        perror("malloc failed for block queue");
+        freeIndex(index);
+        exit(1);
+    }
+    int head = 0, tail = 0;
+    queue[tail++] = start;
+    index->entries[start].loaded = 1;
+
+    parseState state;
+    memset(&state, 0, sizeof(state));
+
+    // --- Breadth first walk over the blocks the directive can reach ---
+    while (head < tail) {
+        blockIndexEntry *entry = &index->entries[queue[head++]];
+
+        // blocks tend to refer to neighbours in the same file, so keep the last one open
+        if (!index->openFile || index->openFileIndex != entry->fileIndex) {
+            if (index->openFile)
+                fclose(index->openFile);
+            index->openFile = fopen(index->fileNames[entry->fileIndex], "r");
+            index->openFileIndex = entry->fileIndex;
+        }
+        FILE *fp = index->openFile;
+
+        if (!fp || fseek(fp, entry->offset, SEEK_SET) != 0) {
+            perror(fp ? "fseek failed on flow file" : "Error opening flow file");
+            free(queue);
+            freeIndex(index);
+            freeMem(*nodes, *nodeCount, *pipes, *pipeCount, *concats, *concatCount, *stderrs, *stderrCount, *files, *fileCount);
+            exit(1);
+        }
+
+        // parse the header and its attributes, stopping at the next block or include
+        char lineBuffer[512];
+        int first = 1;
+        clearCurrentBlock(&state);
+        while (fgets(lineBuffer, sizeof(lineBuffer), fp)) {
+            lineBuffer[strcspn(lineBuffer, "\n")] = '\0';
+            if (!first && (blockHeaderLength(lineBuffer) > 0 || strncmp(lineBuffer, "include=", 8) == 0))
+                break;
+            parseFlowLine(lineBuffer, &state, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
+            first = 0;
+        }
+
+        // collect the names this block refers to
+        const char *refs[3] = {NULL, NULL, NULL};
+        char **parts = NULL;
+        int partCount = 0;
+        if (state.currentPipe) {
+            refs[0] = state.currentPipe->from;
+            refs[1] = state.currentPipe->to;
+        }
+        else if (state.currentStderr) {
+            refs[0] = state.currentStderr->from;
+        }
+        else if (state.currentConcat) {
+            parts = state.currentConcat->parts;
+            partCount = state.currentConcat->partCount;
+        }
+
+        for (int i = 0; i < 3 + partCount; i++) {
+            const char *ref = i < 3 ? refs[i] : parts[i - 3];
+            if (!ref)
+                continue;
+            int next = findIndexEntry(index, ref);
+            if (next != -1 && !index->entries[next].loaded) {
+                index->entries[next].loaded = 1;
+                queue[tail++] = next;
+            }
+        }
+    }
+
+    free(queue);
+}
+
+void freeIndex(flowIndex *index) {
+    for (int i = 0; i < index->entryCount; i++)
+        free(index->entries[i].name);
+    free(index->entries);
+    free(index->buckets);
+
+    for (int i = 0; i < index->fileNameCount; i++)
+        free(index->fileNames[i]);
+    free(index->fileNames);
+    if (index->openFile)
+        fclose(index->openFile);
+    memset(index, 0, sizeof(*index));
+}
+
 char **splitCommand(const char *command) {
     if (!command) 
         return NULL;
@@ -439,36 +1077,1082 @@ void freeArgs(char **args) {
     free(args);
 }
 
-void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef *files, int fileCount) { 
-    
-    static int flowDepth = 0;  
-    static int forkCount = 0;
-    flowDepth++;
+ringBuffer *ringCreate(void) {
+    // memfd backed so both sides of the fork map the same pages
+    int fd = memfd_create("flow-ring", MFD_CLOEXEC);
+    if (fd < 0)
+        return NULL;
 
-    if (flowDepth > MAX_FLOW_DEPTH) {
-        fprintf(stderr, "Error: Cyclical Dependency\n");
-        _exit(1);  // Exit immediately in child
+    size_t size = sizeof(ringBuffer) + RING_SIZE;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return NULL;
     }
 
-    // --- BASE CASE: Check if it's a NODE ---
-    for (int i = 0; i < nodeCount; i++) {
-        if (strcmp(nodes[i].name, blockName) == 0) {
-            
-            if (++forkCount > MAX_FORK_LIMIT) {
-                fprintf(stderr, "Error: Fork limit exceeded (possible cyclical dependency)\n");
-                _exit(1);
-            }
+    ringBuffer *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping keeps the memory alive
+    if (ring == MAP_FAILED)
+        return NULL;
 
-            pid_t pid = fork();
-            if (pid == 0) {
-                char **args = splitCommand(nodes[i].command);
-                execvp(args[0], args);
+    memset(ring, 0, sizeof(ringBuffer));
+    return ring;
+}
+
+void ringDestroy(ringBuffer *ring) {
+    munmap(ring, sizeof(ringBuffer) + RING_SIZE);
+}
+
+void futexWait(int *word, int expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+void futexWake(int *word) {
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+long ringWrite(ringBuffer *ring, const char *buffer, long n) {
+    long written = 0;
+
+    while (written < n) {
+        if (__atomic_load_n(&ring->readerClosed, __ATOMIC_SEQ_CST))
+            return -1;
+
+        unsigned long head = ring->head;
+        unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        unsigned long space = RING_SIZE - (head - tail);
+
+        if (space == 0) {
+            // announce the wait, then re-check so a read in between is never missed
+            int seq = __atomic_load_n(&ring->spaceSeq, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail && !__atomic_load_n(&ring->readerClosed, __ATOMIC_SEQ_CST))
+                futexWait(&ring->spaceSeq, seq);
+            __atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        unsigned long chunk = n - written < (long)space ? (unsigned long)(n - written) : space;
+        unsigned long start = head & (RING_SIZE - 1);
+        unsigned long first = chunk < RING_SIZE - start ? chunk : RING_SIZE - start;
+        memcpy(ring->data + start, buffer + written, first);
+        memcpy(ring->data, buffer + written + first, chunk - first);
+
+        __atomic_store_n(&ring->head, head + chunk, __ATOMIC_SEQ_CST);
+        written += chunk;
+
+        // only pay for a syscall when the consumer is actually asleep
+        if (__atomic_exchange_n(&ring->consumerWaiting, 0, __ATOMIC_SEQ_CST))
+            futexWake(&ring->dataSeq);
+    }
+    return written;
+}
+
+long ringRead(ringBuffer *ring, char *buffer, long n) {
+    while (1) {
+        unsigned long tail = ring->tail;
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+                return 0;  // producer is done and everything was read
+
+            int seq = __atomic_load_n(&ring->dataSeq, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail && !__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST))
+                futexWait(&ring->dataSeq, seq);
+            __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        unsigned long available = head - tail;
+        unsigned long chunk = (unsigned long)n < available ? (unsigned long)n : available;
+        unsigned long start = tail & (RING_SIZE - 1);
+        unsigned long first = chunk < RING_SIZE - start ? chunk : RING_SIZE - start;
+        memcpy(buffer, ring->data + start, first);
+        memcpy(buffer + first, ring->data, chunk - first);
+
+        __atomic_store_n(&ring->tail, tail + chunk, __ATOMIC_SEQ_CST);
+
+        if (__atomic_exchange_n(&ring->producerWaiting, 0, __ATOMIC_SEQ_CST))
+            futexWake(&ring->spaceSeq);
+        return chunk;
+    }
+}
+
+void ringClose(ringBuffer *ring) {
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+    futexWake(&ring->dataSeq);
+}
+
+void ringCloseReader(ringBuffer *ring) {
+    __atomic_store_n(&ring->readerClosed, 1, __ATOMIC_SEQ_CST);
+    futexWake(&ring->spaceSeq);
+}
+
+int isEngineManaged(const char *blockName, fileDef *files, int fileCount) {
+    // file blocks are the stages flow runs itself instead of handing to execvp
+    for (int i = 0; i < fileCount; i++) {
+        if (strcmp(files[i].name, blockName) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+double elapsedSeconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void benchTransport(long totalBytes) {
+    // same chunk the file blocks use, so the numbers describe what the engine does
+    const long chunkSize = RING_CHUNK;
+    const int pingCount = 20000;
+    char *buffer = malloc(chunkSize);
+    if (!buffer) {
+        perror("malloc failed for benchmark buffer");
+        exit(1);
+    }
+    memset(buffer, 'x', chunkSize);
+    struct timespec start;
+
+    // --- Throughput: one producer streams totalBytes to one consumer ---
+    int fd[2];
+    if (pipe(fd) < 0) {
+        perror("pipe failed");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fork() == 0) {
+        close(fd[0]);
+        for (long sent = 0; sent < totalBytes; sent += chunkSize)
+            if (write(fd[1], buffer, chunkSize) < 0)
+                _exit(1);
+        _exit(0);
+    }
+    close(fd[1]);
+    long n;
+    while ((n = read(fd[0], buffer, chunkSize)) > 0)
+        ;
+    close(fd[0]);
+    wait(NULL);
+    double pipeSeconds = elapsedSeconds(&start);
+
+    ringBuffer *ring = ringCreate();
+    if (!ring) {
+        perror("ring buffer setup failed");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fork() == 0) {
+        for (long sent = 0; sent < totalBytes; sent += chunkSize)
+            ringWrite(ring, buffer, chunkSize);
+        ringClose(ring);
+        _exit(0);
+    }
+    while (ringRead(ring, buffer, chunkSize) > 0)
+        ;
+    wait(NULL);
+    double ringSeconds = elapsedSeconds(&start);
+    ringDestroy(ring);
+
+    // --- Latency: one byte ping-pong, half the round trip ---
+    int toChild[2], toParent[2];
+    if (pipe(toChild) < 0 || pipe(toParent) < 0) {
+        perror("pipe failed");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fork() == 0) {
+        char c;
+        for (int i = 0; i < pingCount; i++)
+            if (read(toChild[0], &c, 1) != 1 || write(toParent[1], &c, 1) != 1)
+                _exit(1);
+        _exit(0);
+    }
+    for (int i = 0; i < pingCount; i++)
+        if (write(toChild[1], buffer, 1) != 1 || read(toParent[0], buffer, 1) != 1)
+            break;
+    wait(NULL);
+    double pipeLatency = elapsedSeconds(&start) / pingCount / 2;
+    close(toChild[0]); close(toChild[1]); close(toParent[0]); close(toParent[1]);
+
+    ringBuffer *ping = ringCreate();
+    ringBuffer *pong = ringCreate();
+    if (!ping || !pong) {
+        perror("ring buffer setup failed");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fork() == 0) {
+        char c;
+        for (int i = 0; i < pingCount; i++) {
+            if (ringRead(ping, &c, 1) != 1)
+                _exit(1);
+            ringWrite(pong, &c, 1);
+        }
+        _exit(0);
+    }
+    for (int i = 0; i < pingCount; i++) {
+        ringWrite(ping, buffer, 1);
+        if (ringRead(pong, buffer, 1) != 1)
+            break;
+    }
+    wait(NULL);
+    double ringLatency = elapsedSeconds(&start) / pingCount / 2;
+    ringDestroy(ping);
+    ringDestroy(pong);
+    free(buffer);
+
+    printf("transport  %12s  %12s\n", "MB/s", "latency(us)");
+    printf("pipe()     %12.1f  %12.2f\n", totalBytes / pipeSeconds / (1 << 20), pipeLatency * 1e6);
+    printf("ring       %12.1f  %12.2f\n", totalBytes / ringSeconds / (1 << 20), ringLatency * 1e6);
+}
+
+int parseRlimitName(const char *name) {
+    static const struct {
+        const char *name;
+        int resource;
+    } limits[] = {
+        {"as", RLIMIT_AS}, {"core", RLIMIT_CORE}, {"cpu", RLIMIT_CPU},
+        {"data", RLIMIT_DATA}, {"fsize", RLIMIT_FSIZE}, {"memlock", RLIMIT_MEMLOCK},
+        {"nofile", RLIMIT_NOFILE}, {"nproc", RLIMIT_NPROC}, {"stack", RLIMIT_STACK},
+    };
+
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        if (strcmp(limits[i].name, name) == 0)
+            return limits[i].resource;
+    }
+    return -1;
+}
+
+int parseIoprio(const char *text) {
+    // rt/N, be/N (N 0-7) or idle, returned as the ioprio_set value, -1 if invalid
+    int ioClass;
+    if (strcmp(text, "idle") == 0)
+        return 3 << 13;
+    if (strncmp(text, "rt/", 3) == 0)
+        ioClass = 1;
+    else if (strncmp(text, "be/", 3) == 0)
+        ioClass = 2;
+    else
+        return -1;
+
+    char *end;
+    long level = strtol(text + 3, &end, 10);
+    if (end == text + 3 || *end != '\0' || level < 0 || level > 7)
+        return -1;
+    // class in the bits above IOPRIO_CLASS_SHIFT (13), the level below it
+    return (ioClass << 13) | (int)level;
+}
+
+int parseCpuList(const char *list, cpu_set_t *set) {
+    // comma separated cpus and ranges, e.g. 0-3,6
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p)
+            return -1;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        p = end;
+    }
+    return 0;
+}
+
+int readFirstCpu(const char *path) {
+    // lowest cpu in a sysfs cpu list file (e.g. "4-7,12"), -1 if it can't be read
+    char list[256];
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    int ok = fgets(list, sizeof(list), fp) != NULL;
+    fclose(fp);
+
+    cpu_set_t set;
+    list[strcspn(list, "\n")] = '\0';
+    if (!ok || parseCpuList(list, &set) < 0)
+        return -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set))
+            return cpu;
+    return -1;
+}
+
+int compareCpuTopology(const void *a, const void *b) {
+    const cpuTopology *x = a, *y = b;
+    if (x->numaNode != y->numaNode)
+        return x->numaNode - y->numaNode;
+    if (x->cacheGroup != y->cacheGroup)
+        return x->cacheGroup - y->cacheGroup;
+    if (x->threadIndex != y->threadIndex)
+        return x->threadIndex - y->threadIndex;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+void orderCpusByTopology(int *cpus, int count) {
+    // consecutive cpu numbers can sit on different sockets or be SMT siblings, so sort by
+    // NUMA node, then last level cache, then one thread per core before the siblings;
+    // consecutive stages then share a cache without sharing a core until they have to
+    cpuTopology *topology = malloc(count * sizeof(cpuTopology));
+    if (!topology)
+        return;  // keep the numeric order
+
+    char path[256];
+    for (int i = 0; i < count; i++) {
+        cpuTopology *t = &topology[i];
+        t->cpu = cpus[i];
+
+        // the cpu directory holds a nodeN link for its NUMA node
+        t->numaNode = -1;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", t->cpu);
+        DIR *dir = opendir(path);
+        if (dir) {
+            struct dirent *entry;
+            while ((entry = readdir(dir))) {
+                if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+                    t->numaNode = atoi(entry->d_name + 4);
+                    break;
+                }
+            }
+            closedir(dir);
+        }
+
+        // the highest cache level listed is the last level cache
+        t->cacheGroup = t->cpu;
+        int bestLevel = -1;
+        for (int index = 0; index < 16; index++) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", t->cpu, index);
+            FILE *fp = fopen(path, "r");
+            if (!fp)
+                break;
+            int level = -1;
+            if (fscanf(fp, "%d", &level) != 1)
+                level = -1;
+            fclose(fp);
+            if (level > bestLevel) {
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", t->cpu, index);
+                int first = readFirstCpu(path);
+                if (first >= 0) {
+                    bestLevel = level;
+                    t->cacheGroup = first;
+                }
+            }
+        }
+
+        // position among the hardware threads of the same core
+        t->core = t->cpu;
+        t->threadIndex = 0;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", t->cpu);
+        FILE *fp = fopen(path, "r");
+        if (fp) {
+            char list[256];
+            cpu_set_t set;
+            int ok = fgets(list, sizeof(list), fp) != NULL;
+            fclose(fp);
+            list[strcspn(list, "\n")] = '\0';
+            if (ok && parseCpuList(list, &set) == 0) {
+                for (int cpu = 0; cpu < t->cpu; cpu++) {
+                    if (CPU_ISSET(cpu, &set)) {
+                        if (t->threadIndex == 0)
+                            t->core = cpu;
+                        t->threadIndex++;
+                    }
+                }
+            }
+        }
+    }
+
+    qsort(topology, count, sizeof(cpuTopology), compareCpuTopology);
+    for (int i = 0; i < count; i++)
+        cpus[i] = topology[i].cpu;
+    free(topology);
+}
+
+int applyNodeSettings(nodeDef *node, int pinnedCpu) {
+    // runs in the forked child right before execvp, so only that stage is affected
+    for (int i = 0; i < node->rlimitCount; i++) {
+        struct rlimit limit = {node->rlimits[i].value, node->rlimits[i].value};
+        if (setrlimit(node->rlimits[i].resource, &limit) < 0) {
+            perror("setrlimit failed");
+            return -1;
+        }
+    }
+
+    if (node->hasNice && setpriority(PRIO_PROCESS, 0, node->nice) < 0) {
+        perror("setpriority failed");
+        return -1;
+    }
+
+    // IOPRIO_WHO_PROCESS, the value was built by parseIoprio
+    if (node->hasIoprio) {
+        if (syscall(SYS_ioprio_set, 1, 0, node->ioprio) < 0) {
+            perror("ioprio_set failed");
+            return -1;
+        }
+    }
+
+    cpu_set_t set;
+    if (node->cpus) {
+        if (parseCpuList(node->cpus, &set) < 0) {
+            fprintf(stderr, "Error: node '%s' has an invalid cpus list '%s'\n", node->name, node->cpus);
+            return -1;
+        }
+    }
+    else if (pinnedCpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(pinnedCpu, &set);
+    }
+    else {
+        return 0;
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity failed");
+        return -1;
+    }
+    return 0;
+}
+
+int countStages(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, int depth) {
+    // number of node stages executeFlow will start for blockName, used to number --pin stages
+    if (!blockName || depth > MAX_FLOW_DEPTH)
+        return 0;
+
+    for (int i = 0; i < nodeCount; i++) {
+        if (strcmp(nodes[i].name, blockName) == 0)
+            return 1;
+    }
+    for (int i = 0; i < pipeCount; i++) {
+        if (strcmp(pipes[i].name, blockName) == 0)
+            return countStages(pipes[i].from, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, depth + 1)
+                 + countStages(pipes[i].to, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, depth + 1);
+    }
+    for (int i = 0; i < concatCount; i++) {
+        if (strcmp(concats[i].name, blockName) == 0) {
+            int total = 0;
+            for (int j = 0; j < concats[i].partCount; j++)
+                total += countStages(concats[i].parts[j], nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, depth + 1);
+            return total;
+        }
+    }
+    for (int i = 0; i < stderrCount; i++) {
+        if (strcmp(stderrs[i].name, blockName) == 0)
+            return countStages(stderrs[i].from, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, depth + 1);
+    }
+    return 0;  // file blocks run in flow itself
+}
+
+void traceStage(const char *name, pid_t pid, int pinnedCpu, int status) {
+    // /proc/<pid>/stat: field 19 is nice, field 39 the cpu the stage last ran on
+    char path[64], stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+    int cpu = -1, nice = 0;
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        size_t n = fread(stat, 1, sizeof(stat) - 1, fp);
+        stat[n] = '\0';
+        fclose(fp);
+
+        // the command name can hold spaces, count fields from its closing paren (field 2)
+        char *p = strrchr(stat, ')');
+        for (int field = 3; p && field <= 39; field++) {
+            p = strchr(p + 1, ' ');
+            if (p && field == 19)
+                nice = atoi(p + 1);
+            if (p && field == 39)
+                cpu = atoi(p + 1);
+        }
+    }
+
+    char line[512];
+    int len = snprintf(line, sizeof(line), "trace node=%s pid=%d cpu=%d pinned=%d nice=%d status=%d\n", name, (int)pid, cpu, pinnedCpu, nice, status);
+    if (len > (int)sizeof(line) - 1)
+        len = sizeof(line) - 1;
+    // one write per line so stages tracing at the same time don't interleave
+    if (write(traceFd, line, len) < 0)
+        perror("trace write failed");
+}
+
+const char *pickAgent(nodeDef *node, int stage) {
+    // only called in the forked child of a node, so it can give up with _exit
+    if (node->host && strcmp(node->host, "local") == 0)
+        return NULL;
+    if (node->host && strcmp(node->host, "auto") != 0)
+        return node->host;
+    if (!node->host && agentCount == 0)
+        return NULL;
+
+    if (agentCount == 0) {
+        fprintf(stderr, "Error: node '%s' has host=auto but no --agents were given\n", node->name);
+        _exit(1);
+    }
+
+    // least loaded agent, starting the scan at the stage number so ties spread round robin
+    const char *best = NULL;
+    double bestScore = 0;
+    for (int k = 0; k < agentCount; k++) {
+        const char *agent = agentList[(stage + k) % agentCount];
+        double score = queryAgentLoad(agent);
+        if (score >= 0 && (!best || score < bestScore)) {
+            best = agent;
+            bestScore = score;
+        }
+    }
+
+    if (!best) {
+        fprintf(stderr, "Error: no flow-agent reachable for node '%s'\n", node->name);
+        _exit(1);
+    }
+    return best;
+}
+
+double queryAgentLoad(const char *hostPort) {
+    int sock = connectAgent(hostPort);
+    if (sock < 0)
+        return -1;
+
+    frameHeader header = {0, 0, 0};
+    char reply[FRAME_MAX_PAYLOAD + 1];
+    if (sendFrame(sock, FRAME_LOAD, 0, NULL, 0) < 0 || readFrame(sock, &header, reply) < 0 || header.type != FRAME_LOAD) {
+        if (header.type == FRAME_AUTH)
+            fprintf(stderr, "Error: flow-agent at %s rejected %s\n", hostPort, SECRET_ENV);
+        close(sock);
+        return -1;
+    }
+    close(sock);
+    reply[header.length] = '\0';
+
+    // "running cpus loadavg": commands it runs for us plus everything else, per cpu
+    int running = 0, cpus = 1;
+    double load = 0;
+    if (sscanf(reply, "%d %d %lf", &running, &cpus, &load) != 3 || cpus < 1)
+        return -1;
+    return (running + load) / cpus;
+}
+
+int runRemoteNode(const char *hostPort, char **args, int compressFlags) {
+    int sock = connectAgent(hostPort);
+    if (sock < 0) {
+        fprintf(stderr, "Error: cannot connect to flow-agent at %s\n", hostPort);
+        return 1;
+    }
+
+    // --- EXEC: argv as NUL separated strings ---
+    char command[FRAME_MAX_PAYLOAD];
+    uint32_t length = 0;
+    for (int i = 0; args[i]; i++) {
+        size_t argLength = strlen(args[i]) + 1;
+        if (length + argLength > sizeof(command)) {
+            fprintf(stderr, "Error: command too long for flow-agent\n");
+            close(sock);
+            return 1;
+        }
+        memcpy(command + length, args[i], argLength);
+        length += argLength;
+    }
+    if (sendFrame(sock, FRAME_EXEC, compressFlags, command, length) < 0) {
+        perror("send to flow-agent failed");
+        close(sock);
+        return 1;
+    }
+
+    // --- Pump stdin to the agent and its output back until it reports the exit status ---
+    char *frame = malloc(FRAME_MAX_PAYLOAD);
+    char *data = malloc(DATA_CHUNK);
+    if (!frame || !data) {
+        perror("malloc failed for remote buffers");
+        close(sock);
+        return 1;
+    }
+    long credit = FLOW_WINDOW;   // stdin bytes the agent has room for
+    int stdinOpen = 1;
+    edgeCodec codec;
+    memset(&codec, 0, sizeof(codec));
+    int status = 1;
+
+    while (1) {
+        struct pollfd fds[2] = {{sock, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+        int count = stdinOpen && credit > 0 ? 2 : 1;
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll failed");
+            break;
+        }
+
+        if (count == 2 && fds[1].revents) {
+            ssize_t n = read(STDIN_FILENO, data, credit < DATA_CHUNK ? credit : DATA_CHUNK);
+            int sent;
+            if (n <= 0) {
+                sent = sendFrame(sock, FRAME_EOF, 0, NULL, 0);
+                stdinOpen = 0;
+            }
+            else {
+                sent = sendData(sock, FRAME_STDIN, data, n, compressFlags & COMPRESS_STDIN ? &codec : NULL);
+                credit -= n;
+            }
+            // an agent that has gone away is a failure, not a reader that stopped (no SIGPIPE)
+            if (sent < 0) {
+                fprintf(stderr, "Error: lost connection to flow-agent at %s\n", hostPort);
+                break;
+            }
+        }
+
+        if (fds[0].revents) {
+            frameHeader header;
+            if (readFrame(sock, &header, frame) < 0) {
+                fprintf(stderr, "Error: lost connection to flow-agent at %s\n", hostPort);
+                break;
+            }
+            if (header.type == FRAME_AUTH) {
+                fprintf(stderr, "Error: flow-agent at %s rejected %s\n", hostPort, SECRET_ENV);
+                break;
+            }
+            if (header.type == FRAME_STDOUT || header.type == FRAME_STDERR) {
+                long n = decodeData(&header, frame, data, &codec);
+                if (n < 0) {
+                    fprintf(stderr, "Error: bad data frame from flow-agent at %s\n", hostPort);
+                    break;
+                }
+                if (writeAll(header.type == FRAME_STDOUT ? STDOUT_FILENO : STDERR_FILENO, data, n) < 0) {
+                    perror("write of remote output failed");
+                    break;
+                }
+                // delivered, the agent may send this much more
+                if (sendCount(sock, FRAME_CREDIT, n) < 0) {
+                    fprintf(stderr, "Error: lost connection to flow-agent at %s\n", hostPort);
+                    break;
+                }
+            }
+            else if (header.type == FRAME_CREDIT) {
+                credit += frameCount(frame);
+            }
+            else if (header.type == FRAME_EXIT) {
+                status = frameCount(frame);
+                break;
+            }
+        }
+    }
+
+    codecEnd(&codec);
+    free(frame);
+    free(data);
+    close(sock);
+    return status;
+}
+
+int parsePolicy(const char *name) {
+    if (strcmp(name, "fail_fast") == 0)
+        return POLICY_FAIL_FAST;
+    if (strcmp(name, "continue") == 0)
+        return POLICY_CONTINUE;
+    if (strcmp(name, "pipefail") == 0)
+        return POLICY_PIPEFAIL;
+    return -2;
+}
+
+int blockPolicy(int policy) {
+    return policy == POLICY_DEFAULT ? flowPolicy : policy;
+}
+
+int exitStatus(int waitStatus) {
+    // same convention as the shell: exit code, or 128 + signal number
+    if (WIFSIGNALED(waitStatus))
+        return 128 + WTERMSIG(waitStatus);
+    return WEXITSTATUS(waitStatus);
+}
+
+void signalStage(pid_t pid, int sig) {
+    // a stage leads its own process group only without a terminal, see forkStage
+    if (kill(-pid, sig) < 0)
+        kill(pid, sig);
+}
+
+void forwardSignal(int sig) {
+    // hand the signal down to the stages this process started, and start nothing new
+    cancelled = sig;
+    for (int i = 0; i < liveCount; i++)
+        signalStage(liveChildren[i], sig);
+
+    // whatever is still around after the grace period gets SIGKILL from escalateKill
+    struct itimerval grace = {{0, 0}, {0, CANCEL_GRACE_MS * 1000}};
+    if (liveCount > 0)
+        setitimer(ITIMER_REAL, &grace, NULL);
+}
+
+void escalateKill(int sig) {
+    (void)sig;
+    for (int i = 0; i < liveCount; i++)
+        signalStage(liveChildren[i], SIGKILL);
+}
+
+void installStageHandlers(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_flags = SA_RESTART;
+
+    action.sa_handler = forwardSignal;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    action.sa_handler = escalateKill;
+    sigaction(SIGALRM, &action, NULL);
+}
+
+void blockStageSignals(sigset_t *saved) {
+    // forwardSignal and escalateKill walk liveChildren, keep them out while it changes
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_BLOCK, &set, saved);
+}
+
+pid_t forkStage(void) {
+    pid_t parent = getpid();
+    // blocked across the fork: the parent must not miss the new stage, and the child must
+    // not act on its parent's list before it has cleared it
+    sigset_t saved;
+    blockStageSignals(&saved);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        liveCount = 0;
+        // a stage dies with the process that started it, so a SIGKILL that reaches
+        // an inner process can't leave its stages running
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != parent)
+            _exit(1);
+
+        // own process group so a cancel also reaches processes that were orphaned
+        // before it; with a terminal stages stay in flow's (foreground) group
+        if (stageGroups)
+            setpgid(0, 0);
+        installStageHandlers();
+    }
+    else if (pid > 0 && liveCount < MAX_LIVE_STAGES) {
+        liveChildren[liveCount++] = pid;
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return pid;
+}
+
+int waitStage(pid_t pid, int options) {
+    // reap one stage, returns its exit status or -1 if it is still running (WNOHANG)
+    int status;
+    pid_t done;
+    while ((done = waitpid(pid, &status, options)) < 0 && errno == EINTR)
+        ;
+    if (done == 0)
+        return -1;
+
+    sigset_t saved;
+    blockStageSignals(&saved);
+    int result;
+    if (done < 0) {
+        // reaped somewhere else or never ours: a lost stage must not look like a success
+        fprintf(stderr, "Error: lost track of stage %d (%s)\n", (int)pid, strerror(errno));
+        result = 1;
+    }
+    else {
+        result = exitStatus(status);
+    }
+
+    for (int i = 0; i < liveCount; i++) {
+        if (liveChildren[i] == pid) {
+            liveChildren[i] = liveChildren[--liveCount];
+            break;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return result;
+}
+
+int cancelStage(pid_t pid, const char *name) {
+    if (traceFd >= 0) {
+        char line[512];
+        int len = snprintf(line, sizeof(line), "trace cancel block=%s pid=%d\n", name, (int)pid);
+        if (write(traceFd, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1) < 0)
+            perror("trace write failed");
+    }
+
+    // everything the stage started is signalled by pid, so the cancel reaches it whether or
+    // not the stage leads its own process group (it doesn't when flow has a terminal);
+    // the pids are taken before anything dies, once orphaned they can't be found from here
+    pid_t tree[MAX_CANCEL_TREE];
+    int treeCount = collectStageTree(pid, tree, MAX_CANCEL_TREE);
+
+    // ask nicely first; an inner process escalates to SIGKILL for its own stages after
+    // CANCEL_GRACE_MS, and whatever is still here after twice that gets SIGKILL as well
+    signalStage(pid, SIGTERM);
+    for (int i = 1; i < treeCount; i++)
+        kill(tree[i], SIGTERM);
+
+    struct timespec tick = {0, 10 * 1000000L};
+    int status = -1;
+    for (int waited = 0; waited < 2 * CANCEL_GRACE_MS; waited += 10) {
+        if (status < 0)
+            status = waitStage(pid, WNOHANG);
+        int remaining = 0;
+        for (int i = 1; i < treeCount; i++)
+            remaining += processRunning(tree[i]);
+        if (status >= 0 && remaining == 0)
+            return status;
+        nanosleep(&tick, NULL);
+    }
+
+    if (status < 0) {
+        // still running: it may have started more since, look again
+        signalStage(pid, SIGKILL);
+        pid_t late[MAX_CANCEL_TREE];
+        int lateCount = collectStageTree(pid, late, MAX_CANCEL_TREE);
+        for (int i = 1; i < lateCount; i++)
+            kill(late[i], SIGKILL);
+    }
+    for (int i = 1; i < treeCount; i++)
+        kill(tree[i], SIGKILL);
+    return status >= 0 ? status : waitStage(pid, 0);
+}
+
+int processRunning(pid_t pid) {
+    // a zombie is done even if nobody (e.g. a pid 1 that doesn't reap) has collected it yet
+    char path[64], stat[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    size_t n = fread(stat, 1, sizeof(stat) - 1, fp);
+    stat[n] = '\0';
+    fclose(fp);
+
+    char *p = strrchr(stat, ')');
+    char state;
+    return p && sscanf(p + 1, " %c", &state) == 1 && state != 'Z';
+}
+
+int collectStageTree(pid_t root, pid_t *tree, int max) {
+    // root and every process below it, from the ppid field (4) of /proc/<pid>/stat;
+    // only done when a stage is cancelled, so one pass over /proc is cheap enough
+    int count = 0, cap = 0;
+    pid_t *pids = NULL, *parents = NULL;
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    while (proc && (entry = readdir(proc))) {
+        char *end;
+        long pid = strtol(entry->d_name, &end, 10);
+        if (end == entry->d_name || *end != '\0')
+            continue;
+
+        char path[64], stat[512];
+        snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            continue;  // already gone
+        size_t n = fread(stat, 1, sizeof(stat) - 1, fp);
+        stat[n] = '\0';
+        fclose(fp);
+
+        // the command name can hold spaces, ") S ppid" follows its closing paren
+        char *p = strrchr(stat, ')');
+        int ppid;
+        if (!p || sscanf(p + 1, " %*c %d", &ppid) != 1)
+            continue;
+
+        if (count >= cap) {
+            int newCap = cap ? cap * 2 : 256;
+            pid_t *newPids = realloc(pids, newCap * sizeof(pid_t));
+            if (newPids)
+                pids = newPids;
+            pid_t *newParents = realloc(parents, newCap * sizeof(pid_t));
+            if (newParents)
+                parents = newParents;
+            if (!newPids || !newParents)
+                break;  // cancel what was found so far
+            cap = newCap;
+        }
+        pids[count] = pid;
+        parents[count] = ppid;
+        count++;
+    }
+    if (proc)
+        closedir(proc);
+
+    // --- Breadth first from the root, the tree array doubles as the queue ---
+    int treeCount = 0;
+    tree[treeCount++] = root;
+    for (int head = 0; head < treeCount; head++) {
+        for (int i = 0; i < count && treeCount < max; i++) {
+            if (parents[i] == tree[head])
+                tree[treeCount++] = pids[i];
+        }
+    }
+
+    free(pids);
+    free(parents);
+    return treeCount;
+}
+
+int waitPipeSides(pid_t fromPid, pid_t toPid, const char *fromName, const char *toName, int policy, ringBuffer *ring) {
+    int fromStatus = -1, toStatus = -1;
+    int fromFailedFirst = 0;
+
+    // --- Reap the two sides in whatever order they finish ---
+    struct timespec tick = {0, 10 * 1000000L};
+    while (fromStatus < 0 || toStatus < 0) {
+        // look at whichever child finished first without reaping it, only our two sides are
+        // reaped (by pid), anything else is left for whoever owns it
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR)
+            continue;
+
+        pid_t done = info.si_pid;
+        int status;
+        if (done == fromPid || done == toPid) {
+            status = waitStage(done, 0);
+        }
+        else if (done > 0) {
+            // a child that isn't one of the sides has finished first, check ours directly
+            done = 0;
+            if (fromStatus < 0 && (status = waitStage(fromPid, WNOHANG)) >= 0)
+                done = fromPid;
+            else if (toStatus < 0 && (status = waitStage(toPid, WNOHANG)) >= 0)
+                done = toPid;
+            if (!done) {
+                nanosleep(&tick, NULL);
+                continue;
+            }
+        }
+        else {
+            // no children left (ECHILD): a side was reaped elsewhere, waitStage reports it as an error
+            done = fromStatus < 0 ? fromPid : toPid;
+            status = waitStage(done, 0);
+        }
+
+        if (done == fromPid) {
+            fromStatus = status;
+            if (fromStatus != 0 && toStatus < 0)
+                fromFailedFirst = 1;
+            // a producer that exited early (e.g. its file could not be opened) never closed
+            // the ring, do it here so the reader sees end of input instead of waiting forever
+            if (ring)
+                ringClose(ring);
+            // nothing more will arrive, downstream can't produce anything useful; SIGPIPE
+            // means the to side already stopped reading, so it is left to finish on its own
+            if (fromStatus != 0 && fromStatus != 128 + SIGPIPE && policy == POLICY_FAIL_FAST && toStatus < 0)
+                toStatus = cancelStage(toPid, toName);
+        }
+        else if (done == toPid) {
+            toStatus = status;
+            // a ring has no SIGPIPE, tell the producer its reader is gone
+            if (ring)
+                ringCloseReader(ring);
+            if (toStatus != 0 && policy == POLICY_FAIL_FAST && fromStatus < 0)
+                fromStatus = cancelStage(fromPid, fromName);
+        }
+    }
+
+    if (policy == POLICY_CONTINUE)
+        return toStatus;
+    if (policy == POLICY_FAIL_FAST) {
+        // a writer killed by SIGPIPE after its reader finished fine is not a failure (yes | head)
+        if (fromStatus == 128 + SIGPIPE && toStatus == 0)
+            return 0;
+        return fromFailedFirst ? fromStatus : toStatus != 0 ? toStatus : fromStatus;
+    }
+    return toStatus != 0 ? toStatus : fromStatus;  // pipefail: rightmost failure
+}
+
+int executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef *files, int fileCount) { 
+    
+    static int flowDepth = 0;  
+    static int forkCount = 0;
+    flowDepth++;
+
+    if (flowDepth > MAX_FLOW_DEPTH) {
+        fprintf(stderr, "Error: Cyclical Dependency\n");
+        _exit(1);  // Exit immediately in child
+    }
+
+    // a cancel reached this process, don't start anything new
+    if (cancelled) {
+        flowDepth--;
+        return 128 + cancelled;
+    }
+
+    // --- BASE CASE: Check if it's a NODE ---
+    for (int i = 0; i < nodeCount; i++) {
+        if (strcmp(nodes[i].name, blockName) == 0) {
+            
+            if (++forkCount > MAX_FORK_LIMIT) {
+                fprintf(stderr, "Error: Fork limit exceeded (possible cyclical dependency)\n");
+                _exit(1);
+            }
+
+            // explicit cpus= wins over --pin
+            int stage = pinBase++;
+            int pinnedCpu = -1;
+            if (pinStages && !nodes[i].cpus && pinCpuCount > 0)
+                pinnedCpu = pinCpus[stage % pinCpuCount];
+
+            int status = 1;
+            pid_t pid = forkStage();
+            if (pid == 0) {
+                // the command (or the remote connection) handles signals the default way
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGINT, SIG_DFL);
+                char **args = splitCommand(nodes[i].command);
+
+                // remote node: this child stays behind as the local end of the agent connection
+                const char *host = pickAgent(&nodes[i], stage);
+                if (host) {
+                    int remoteStatus = runRemoteNode(host, args, nodes[i].compress);
+                    freeArgs(args);
+                    _exit(remoteStatus);
+                }
+
+                if (applyNodeSettings(&nodes[i], pinnedCpu) < 0) {
+                    freeArgs(args);
+                    _exit(1);
+                }
+                execvp(args[0], args);
                 fprintf(stderr, "execvp failed\n");
                 freeArgs(args);
                 _exit(1);   
             }    
             else if (pid > 0) {
-                wait(NULL);
+                if (traceFd >= 0) {
+                    // look at the finished child before reaping it, /proc still has it
+                    // (if waitid fails there is nothing to look at, waitStage reports the error)
+                    siginfo_t info;
+                    int peeked;
+                    while ((peeked = waitid(P_PID, pid, &info, WEXITED | WNOWAIT)) < 0 && errno == EINTR)
+                        ;
+                    if (peeked == 0)
+                        traceStage(nodes[i].name, pid, pinnedCpu, info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status);
+                }
+                status = waitStage(pid, 0);
             }
             else {
                 perror("fork failed\n");
@@ -476,7 +2160,7 @@ void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *
                 _exit(1);
             }
             flowDepth--;
-            return;
+            return status;
         }
     }
 
@@ -484,61 +2168,117 @@ void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *
     for (int i = 0; i < pipeCount; i++) {
         if (strcmp(pipes[i].name, blockName) == 0) {
 
-            int fd[2];
-            if (pipe(fd) < 0) {
+            // Both ends run inside flow: move the bytes through a shared memory ring
+            int useRing = isEngineManaged(pipes[i].from, files, fileCount) && isEngineManaged(pipes[i].to, files, fileCount);
+            ringBuffer *ring = NULL;
+            int fd[2] = {-1, -1};
+
+            if (useRing) {
+                ring = ringCreate();
+                if (!ring) {
+                    perror("ring buffer setup failed");
+                    freeMem(nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
+                    exit(1);
+                }
+            }
+            else if (pipe(fd) < 0) {
                 perror("pipe failed\n");
                 freeMem(nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount); 
                 exit(1);
             }
 
-            if (++forkCount > MAX_FORK_LIMIT) {
+            forkCount += 2;
+            if (forkCount > MAX_FORK_LIMIT) {
                 fprintf(stderr, "Error: Fork limit exceeded (possible cyclical dependecy)\n");
                 _exit(1);
             }
 
+            int fromStages = countStages(pipes[i].from, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, 0);
 
-            pid_t pid = fork();
-            if (pid < 0) {
+            pid_t fromPid = forkStage();
+            if (fromPid < 0) {
                 perror("fork failed\n");
                 freeMem(nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount); 
                 _exit(1);
             }
 
-            if (pid == 0) {
-                // --- CHILD PROCESS: executes the 'from' side ---
-                close(fd[0]);            // Close read end
-                dup2(fd[1], STDOUT_FILENO); // Redirect stdout to pipe write end
-                close(fd[1]);
-                
+            if (fromPid == 0) {
+                // --- FROM CHILD: writes into the pipe (or ring) ---
+                if (ring) {
+                    flowOutRing = ring;
+                }
+                else {
+                    close(fd[0]);            // Close read end
+                    dup2(fd[1], STDOUT_FILENO); // Redirect stdout to pipe write end
+                    close(fd[1]);
+                }
+
                 // Recursively execute whatever "from" points to
-                executeFlow(pipes[i].from, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
-                _exit(0);
-            } 
-            else if (pid > 0) {
-                // --- PARENT PROCESS: executes the 'to' side ---
-                close(fd[1]);            // Close write end
-                dup2(fd[0], STDIN_FILENO); // Redirect stdin to pipe read end
-                close(fd[0]);
+                int status = executeFlow(pipes[i].from, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
+                if (ring)
+                    ringClose(ring);
+                _exit(status);
+            }
+
+            pid_t toPid = forkStage();
+            if (toPid < 0) {
+                perror("fork failed\n");
+                freeMem(nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount); 
+                _exit(1);
+            }
+
+            if (toPid == 0) {
+                // --- TO CHILD: reads from the pipe (or ring) ---
+                // the from child numbered its stages, carry on after them so the chain sits on adjacent cpus
+                pinBase += fromStages;
+                if (ring) {
+                    flowInRing = ring;
+                }
+                else {
+                    close(fd[1]);            // Close write end
+                    dup2(fd[0], STDIN_FILENO); // Redirect stdin to pipe read end
+                    close(fd[0]);
+                }
 
                 // Recursively execute whatever "to" points to
-                executeFlow(pipes[i].to, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
-                wait(NULL);
-                flowDepth--;
-                return;
+                _exit(executeFlow(pipes[i].to, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount));
             }
+
+            // --- PARENT PROCESS: keeps no pipe ends, so either side sees EOF/SIGPIPE when the other goes away ---
+            if (!ring) {
+                close(fd[0]);
+                close(fd[1]);
+            }
+            pinBase += fromStages + countStages(pipes[i].to, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, 0);
+
+            int status = waitPipeSides(fromPid, toPid, pipes[i].from, pipes[i].to, blockPolicy(pipes[i].policy), ring);
+            if (ring)
+                ringDestroy(ring);
+            flowDepth--;
+            return status;
         }
     }
     
     // --- CONCAT CASE ---
     for (int i = 0; i < concatCount; i++) {
         if (strcmp(concats[i].name, blockName) == 0) {
+            int policy = blockPolicy(concats[i].policy);
+            int status = 0;
+            int lastFailure = 0;
+
             for (int j = 0; j < concats[i].partCount; j++) {
                 // Execute each part sequentially
-                executeFlow(concats[i].parts[j], nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
+                status = executeFlow(concats[i].parts[j], nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
+                if (status != 0) {
+                    lastFailure = status;
+                    // the remaining parts can't fix the output any more, skip them
+                    if (policy == POLICY_FAIL_FAST)
+                        break;
+                }
             }
             // Return to prevent falling through to other block types
             flowDepth--;
-            return;
+            return policy == POLICY_CONTINUE ? status : lastFailure;
         }
     }
 
@@ -551,7 +2291,7 @@ void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *
                 _exit(1);
             }
         
-        pid_t pid = fork();
+        pid_t pid = forkStage();
         if (pid < 0) {
             perror("fork failed for stderr block");
             freeMem(nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount); 
@@ -563,14 +2303,14 @@ void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *
             dup2(STDOUT_FILENO, STDERR_FILENO);
 
             // Execute the node whose stderr we’re merging
-            executeFlow(stderrs[i].from, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount);
-            _exit(0);
+            _exit(executeFlow(stderrs[i].from, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, files, fileCount));
         } 
         else if (pid > 0) {
             // --- PARENT PROCESS ---
-            wait(NULL);
+            pinBase += countStages(stderrs[i].from, nodes, nodeCount, pipes, pipeCount, concats, concatCount, stderrs, stderrCount, 0);
+            int status = waitStage(pid, 0);
             flowDepth--;
-            return;
+            return status;
             }
         }
     }
@@ -608,9 +2348,17 @@ void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *
                     _exit(1);
                 }
 
-                char buffer[1024];
+                static char buffer[RING_CHUNK];
                 int n;
                 while ((n = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+                    if (flowOutRing) {
+                        // reader gone: exit the way a pipe writer does on SIGPIPE
+                        if (ringWrite(flowOutRing, buffer, n) < 0) {
+                            fclose(input);
+                            _exit(128 + SIGPIPE);
+                        }
+                        continue;
+                    }
                     if (fwrite(buffer, 1, n, stdout) != n) {
                         perror("write to pipe failed");
                         fclose(input);
@@ -638,7 +2386,7 @@ void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *
                 }
 
                 flowDepth--;
-                return;
+                return 0;
             }
             else if (isOutput) {
                 // --- Output file case ---
@@ -649,9 +2397,9 @@ void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *
                     _exit(1);
                 }
 
-                char buffer[1024];
+                static char buffer[RING_CHUNK];
                 int n;
-                while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+                while ((n = flowInRing ? ringRead(flowInRing, buffer, sizeof(buffer)) : (int)fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
                     if (fwrite(buffer, 1, n, output) != n) {
                         perror("Error writing to output file");
                         fclose(output);
@@ -661,10 +2409,18 @@ void executeFlow(const char *blockName, nodeDef *nodes, int nodeCount, pipeDef *
                     }
                 }
                 fclose(output);
-                return;
+                flowDepth--;
+                return 0;
             }
+
+            flowDepth--;
+            return 0;
         }
     }
+
+    fprintf(stderr, "Error: block '%s' is not defined\n", blockName);
+    flowDepth--;
+    return 1;
 }
 
 int hasCycleUtil(const char *block, nodeDef *nodes, int nodeCount, pipeDef *pipes, int pipeCount, concatDef *concats, int concatCount, stderrDef *stderrs, int stderrCount, fileDef *files, int fileCount, char **visited, char **recStack, int depth) {
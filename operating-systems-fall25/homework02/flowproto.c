@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#include "flowproto.h"
+
+int writeAll(int fd, const void *buffer, size_t n) {
+    const char *p = buffer;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+int sendAll(int sock, const void *buffer, size_t n) {
+    // like writeAll, but a closed connection is an error instead of a SIGPIPE
+    const char *p = buffer;
+    while (n > 0) {
+        ssize_t w = send(sock, p, n, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+int readAll(int fd, void *buffer, size_t n) {
+    char *p = buffer;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+int sendFrame(int fd, int type, int flags, const void *payload, uint32_t length) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    uint32_t netLength = htonl(length);
+    header[0] = type;
+    header[1] = flags;
+    memcpy(header + 2, &netLength, 4);
+
+    if (sendAll(fd, header, sizeof(header)) < 0)
+        return -1;
+    return length ? sendAll(fd, payload, length) : 0;
+}
+
+int sendCount(int fd, int type, uint32_t count) {
+    uint32_t netCount = htonl(count);
+    return sendFrame(fd, type, 0, &netCount, sizeof(netCount));
+}
+
+int sendData(int fd, int type, const char *data, uint32_t n, edgeCodec *codec) {
+    // codec NULL: the edge is not compressed
+    if (!codec)
+        return sendFrame(fd, type, 0, data, n);
+
+    z_stream *stream = &codec->deflater;
+    if (!codec->deflating) {
+        memset(stream, 0, sizeof(*stream));
+        if (deflateInit(stream, 1) != Z_OK)   // fast level
+            return -1;
+        codec->deflating = 1;
+    }
+
+    // a sync flush puts out everything fed so far, so the receiver can inflate this frame
+    // on its own while the dictionary keeps growing; DATA_CHUNK plus the flush overhead
+    // stays well below FRAME_MAX_PAYLOAD
+    unsigned char packed[FRAME_MAX_PAYLOAD];
+    stream->next_in = (Bytef *)data;
+    stream->avail_in = n;
+    stream->next_out = packed;
+    stream->avail_out = sizeof(packed);
+    if (deflate(stream, Z_SYNC_FLUSH) != Z_OK || stream->avail_in != 0 || stream->avail_out == 0)
+        return -1;
+    return sendFrame(fd, type, FRAME_COMPRESSED, packed, sizeof(packed) - stream->avail_out);
+}
+
+int readFrame(int fd, frameHeader *header, char *payload) {
+    unsigned char raw[FRAME_HEADER_SIZE];
+    uint32_t netLength;
+    if (readAll(fd, raw, sizeof(raw)) < 0)
+        return -1;
+
+    memcpy(&netLength, raw + 2, 4);
+    header->type = raw[0];
+    header->flags = raw[1];
+    header->length = ntohl(netLength);
+    if (header->length > FRAME_MAX_PAYLOAD)
+        return -1;
+    return header->length ? readAll(fd, payload, header->length) : 0;
+}
+
+long decodeData(frameHeader *header, const char *payload, char *out, edgeCodec *codec) {
+    // out must hold DATA_CHUNK bytes, returns the raw length or -1
+    if (!(header->flags & FRAME_COMPRESSED)) {
+        if (header->length > DATA_CHUNK)
+            return -1;
+        memcpy(out, payload, header->length);
+        return header->length;
+    }
+
+    z_stream *stream = &codec->inflater;
+    if (!codec->inflating) {
+        memset(stream, 0, sizeof(*stream));
+        if (inflateInit(stream) != Z_OK)
+            return -1;
+        codec->inflating = 1;
+    }
+
+    // the sender flushed after at most DATA_CHUNK bytes, so the whole frame fits in out
+    stream->next_in = (Bytef *)payload;
+    stream->avail_in = header->length;
+    stream->next_out = (Bytef *)out;
+    stream->avail_out = DATA_CHUNK;
+    int result = inflate(stream, Z_SYNC_FLUSH);
+    if ((result != Z_OK && result != Z_BUF_ERROR) || stream->avail_in != 0)
+        return -1;
+    return DATA_CHUNK - stream->avail_out;
+}
+
+void codecEnd(edgeCodec *codec) {
+    if (codec->deflating)
+        deflateEnd(&codec->deflater);
+    if (codec->inflating)
+        inflateEnd(&codec->inflater);
+    codec->deflating = codec->inflating = 0;
+}
+
+uint32_t frameCount(const char *payload) {
+    uint32_t netCount;
+    memcpy(&netCount, payload, sizeof(netCount));
+    return ntohl(netCount);
+}
+
+void tuneSocket(int fd) {
+    int one = 1, size = SOCKET_BUFFER;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+struct addrinfo *resolveHostPort(const char *hostPort, int passive) {
+    // "host:port", or just "port" for the loopback address
+    char host[256] = "127.0.0.1";
+    const char *port = hostPort;
+    const char *colon = strrchr(hostPort, ':');
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - hostPort), hostPort);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    int err = getaddrinfo(host, port, &hints, &result);
+    if (err != 0) {
+        fprintf(stderr, "Error: cannot resolve '%s': %s\n", hostPort, gai_strerror(err));
+        return NULL;
+    }
+    return result;
+}
+
+int connectAgent(const char *hostPort) {
+    const char *secret = getenv(SECRET_ENV);
+    if (!secret || !*secret) {
+        fprintf(stderr, "Error: %s is not set, flow-agent serves no client without it\n", SECRET_ENV);
+        return -1;
+    }
+
+    struct addrinfo *result = resolveHostPort(hostPort, 0);
+    if (!result)
+        return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        // buffer sizes have to be set before connect to take part in the window
+        tuneSocket(fd);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    // every connection starts by proving it knows the agent's secret
+    if (fd >= 0 && sendFrame(fd, FRAME_AUTH, 0, secret, strlen(secret)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int secretMatches(const char *payload, uint32_t length) {
+    const char *secret = getenv(SECRET_ENV);
+    if (!secret || !*secret)
+        return 0;
+    size_t secretLength = strlen(secret);
+
+    // compare every byte so the time taken doesn't leak how much of the secret was right
+    unsigned char diff = length != secretLength;
+    for (uint32_t i = 0; i < length; i++)
+        diff |= payload[i] ^ secret[i < secretLength ? i : 0];
+    return diff == 0;
+}
+
+int listenAgent(const char *hostPort) {
+    struct addrinfo *result = resolveHostPort(hostPort, 1);
+    if (!result)
+        return -1;
+
+    int fd = -1, one = 1;
+    for (struct addrinfo *ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        tuneSocket(fd);  // accepted sockets inherit these
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
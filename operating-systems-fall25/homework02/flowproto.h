@@ -0,0 +1,66 @@
+#ifndef FLOWPROTO_H
+#define FLOWPROTO_H
+
+#include <stdint.h>
+#include <zlib.h>
+
+// Wire protocol between flow (client) and flow-agent, one TCP connection per remote node.
+// Every frame is a 6 byte header (type, flags, payload length in network order) plus payload.
+
+#define FRAME_HEADER_SIZE 6
+#define FRAME_MAX_PAYLOAD (32 * 1024)
+#define DATA_CHUNK (16 * 1024)        // most raw bytes carried by one data frame
+#define FLOW_WINDOW (64 * 1024)       // bytes a sender may have in flight before it needs credit
+#define SOCKET_BUFFER (256 * 1024)    // comfortably above FLOW_WINDOW so credit limited sends never block
+
+#define FRAME_EXEC   1   // client -> agent: argv as NUL separated strings, flags = COMPRESS_* for the edges
+#define FRAME_STDIN  2   // client -> agent: data for the command's stdin
+#define FRAME_EOF    3   // client -> agent: stdin is finished
+#define FRAME_STDOUT 4   // agent -> client: data the command wrote to stdout
+#define FRAME_STDERR 5   // agent -> client: data the command wrote to stderr
+#define FRAME_CREDIT 6   // either way: 4 byte count of data bytes the receiver has delivered
+#define FRAME_EXIT   7   // agent -> client: 4 byte exit status (128 + signal when killed)
+#define FRAME_LOAD   8   // client -> agent asks, agent -> client answers "running cpus loadavg"
+#define FRAME_AUTH   9   // client -> agent, always the first frame: the shared secret
+                         // agent -> client: the secret was rejected, the agent closes afterwards
+
+#define SECRET_ENV "FLOW_AGENT_SECRET"   // shared secret both binaries read from the environment
+
+#define FRAME_COMPRESSED 1   // data frame flag: payload continues the sender's zlib stream
+
+#define COMPRESS_STDIN  1    // EXEC flags: which edges of the node are compressed
+#define COMPRESS_STDOUT 2
+
+struct addrinfo;
+
+typedef struct {
+    int type;
+    int flags;
+    uint32_t length;
+} frameHeader;
+
+// one zlib stream per direction of a connection, kept for the whole session so the
+// dictionary carries across frames; each frame ends with a sync flush
+typedef struct {
+    z_stream deflater;   // data we send
+    z_stream inflater;   // data we receive
+    int deflating, inflating;   // set once the stream has been initialised
+} edgeCodec;
+
+int writeAll(int fd, const void *buffer, size_t n);
+int sendAll(int sock, const void *buffer, size_t n);
+int readAll(int fd, void *buffer, size_t n);
+int sendFrame(int fd, int type, int flags, const void *payload, uint32_t length);
+int sendCount(int fd, int type, uint32_t count);
+int sendData(int fd, int type, const char *data, uint32_t n, edgeCodec *codec);
+int readFrame(int fd, frameHeader *header, char *payload);
+long decodeData(frameHeader *header, const char *payload, char *out, edgeCodec *codec);
+void codecEnd(edgeCodec *codec);
+uint32_t frameCount(const char *payload);
+void tuneSocket(int fd);
+struct addrinfo *resolveHostPort(const char *hostPort, int passive);
+int connectAgent(const char *hostPort);
+int secretMatches(const char *payload, uint32_t length);
+int listenAgent(const char *hostPort);
+
+#endif